@@ -3,7 +3,7 @@
 
 #include <stdint.h>
 
-#define NUM_BLOCKS 100
+#define NUM_BLOCKS 1024
 
 /*
  * @short force an index to be set.
@@ -21,17 +21,84 @@ void force_set_index(uint32_t index);
  */
 uint32_t get_index();
 
+/*
+ * @short find the first free data block in the range [start, end)
+ * @return index of data block to use, or NUM_BLOCKS if the range is full
+ */
+uint32_t get_index_in(uint32_t start, uint32_t end);
+
 /*
  * @short frees an index
  * @param index the index to free
  */
 void rm_index(uint32_t index);
 
+/*
+ * @short frees the n indices starting at start
+ * @long Whole bytes of the bitmap are freed at once and the free extent index
+ *       is updated once for the whole run, so freeing an extent costs about
+ *       as much as freeing a single block.
+ */
+void rm_run(uint32_t start, uint32_t n);
+
+/*
+ * @short allocate a block in [start, end) from the calling thread's pool
+ * @long Each thread keeps a private pool of up to RESV_CHUNK blocks that it
+ *       has claimed from the shared bitmap. Allocations are served from the
+ *       pool without searching the bitmap or taking ext_lock, and the pool is
+ *       refilled with one pass over the bitmap, and one update of the free
+ *       extent index, when it runs dry or the requested range changes.
+ *       Blocks sitting in a pool are marked used in the bitmap, so they can
+ *       not be handed to another thread, and set in resv_bit_map, so that
+ *       whoever writes the bitmap out can still record them as free.
+ * @return index of data block to use, or NUM_BLOCKS if the range is full
+ */
+uint32_t get_index_reserved(uint32_t start, uint32_t end);
+
+/*
+ * @short forget every reservation, after the bitmap has been replaced
+ * @long Pools filled before the call, in any thread, are dropped without
+ *       touching the bitmap the next time they are used, since their blocks
+ *       were taken from the old one.
+ */
+void resv_reset();
+
+/*
+ * @short return the unused blocks in the calling thread's pool to the bitmap
+ * @long get_index_reserved() does this itself when asked for another range.
+ *       Callers that track which parts of the bitmap changed should flush the
+ *       pool themselves first, so that they see the blocks it returns.
+ */
+void flush_reservation();
+
+/*
+ * @short allocate n contiguous free blocks inside [start, end)
+ * @long Uses the free extent index to find the first run of at least n free
+ *       blocks that starts at or after start in O(log NUM_BLOCKS) steps, and
+ *       marks the whole run used.
+ * @return index of the first block of the run, or NUM_BLOCKS if there is none
+ */
+uint32_t get_run(uint32_t start, uint32_t end, uint32_t n);
+
+/*
+ * @short length of the longest run of free blocks on the disk
+ */
+uint32_t largest_run();
+
+/*
+ * @short rebuild the free extent index from the bitmap
+ * @long Call after the bitmap has been changed in bulk, e.g. after reading it
+ *       from the disk.
+ */
+void ext_rebuild();
+
 
 // free bitmap for OS file systems assignment
 
 
+#include <string.h>
 #include <strings.h>    // for `ffs`
+#include <pthread.h>
 
 /* constants */
 // how far to loop in array
@@ -42,39 +109,313 @@ void rm_index(uint32_t index);
 // the actual data. initialize all bits to high
 uint8_t free_bit_map[SIZE] = { [0 ... SIZE-1] = UINT8_MAX };
 
+// how many blocks a thread reserves from the bitmap at a time
+#define RESV_CHUNK 16
+
+// the blocks sitting in the reservation pool of any thread. They are used in
+// free_bit_map but nothing has been written to them yet, so a copy of the
+// bitmap going to disk should show them as free.
+uint8_t resv_bit_map[SIZE];
+
+// bumped by resv_reset(); a pool filled under an older value is stale
+uint32_t resv_gen = 0;
+
 /* macros */
+// The bitmap is shared between threads, so bits are flipped with atomic
+// read-modify-write operations. USE_BIT evaluates to non-zero only if this
+// call is the one that took the bit, so two threads racing for the same free
+// bit can not both get it.
 #define FREE_BIT(_data, _which_bit) \
-    _data = _data | (1 << _which_bit)
+    __atomic_fetch_or(&(_data), (uint8_t)(1 << (_which_bit)), __ATOMIC_RELEASE)
 
 #define USE_BIT(_data, _which_bit) \
-    _data = _data & ~(1 << _which_bit)
+    (__atomic_fetch_and(&(_data), (uint8_t)~(1 << (_which_bit)), \
+                        __ATOMIC_ACQUIRE) & (1 << (_which_bit)))
+
+/* per-thread reservation pool */
+typedef struct {
+    uint32_t start, end;        // range the pool was filled from
+    uint32_t gen;               // resv_gen when the pool was filled
+    uint32_t n;                 // number of blocks left in the pool
+    uint32_t blks[RESV_CHUNK];  // reserved blocks, handed out from the end
+} resv_pool_t;
+
+static __thread resv_pool_t resv_pool;
+
+/* free extent index */
+// A segment tree over the blocks of the disk, stored as an implicit binary
+// heap with the leaves at [NUM_BLOCKS, 2*NUM_BLOCKS). Each node covers a range
+// of blocks and records the length of the free run at the start of its range
+// (pre), at the end of its range (suf) and the longest free run anywhere in it
+// (best). That is enough to find the first run of n free blocks after a given
+// block in logarithmic time, and updating one bit only touches the nodes on
+// the path to the root. NUM_BLOCKS must be a power of two.
+typedef struct {
+    uint16_t pre, suf, best;
+} ext_node_t;
+
+ext_node_t ext_tree[2 * NUM_BLOCKS];
+pthread_mutex_t ext_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ext_pull(uint32_t node, uint32_t len) {
+    ext_node_t *l = &ext_tree[2*node], *r = &ext_tree[2*node + 1];
+    ext_node_t *n = &ext_tree[node];
+    uint32_t half = len / 2;
+
+    n->pre = l->pre == half ? half + r->pre : l->pre;
+    n->suf = r->suf == half ? half + l->suf : r->suf;
+    n->best = l->best > r->best ? l->best : r->best;
+    if (l->suf + r->pre > n->best) n->best = l->suf + r->pre;
+}
+
+// Brings the leaf for index back in line with its bit in the bitmap. Reading
+// the bit under the lock, rather than being told the new value, keeps the
+// index correct when threads race to flip the same bit.
+static void ext_sync(uint32_t index) {
+    uint32_t node, len;
+
+    if (index >= NUM_BLOCKS) return;
+    pthread_mutex_lock(&ext_lock);
+    node = NUM_BLOCKS + index;
+    len = (__atomic_load_n(&free_bit_map[index/8], __ATOMIC_RELAXED) >> (index % 8)) & 1;
+    ext_tree[node].pre = ext_tree[node].suf = ext_tree[node].best = len;
+    for (node /= 2, len = 2; node > 0; node /= 2, len *= 2)
+        ext_pull(node, len);
+    pthread_mutex_unlock(&ext_lock);
+}
+
+// Same as ext_sync() for every index in [start, end), but each node above the
+// leaves is recomputed only once.
+static void ext_sync_range(uint32_t start, uint32_t end) {
+    uint32_t i, node, lo, hi, len;
+
+    if (end > NUM_BLOCKS) end = NUM_BLOCKS;
+    if (start >= end) return;
+    pthread_mutex_lock(&ext_lock);
+    for (i = start; i < end; i++) {
+        len = (__atomic_load_n(&free_bit_map[i/8], __ATOMIC_RELAXED) >> (i % 8)) & 1;
+        node = NUM_BLOCKS + i;
+        ext_tree[node].pre = ext_tree[node].suf = ext_tree[node].best = len;
+    }
+    lo = (NUM_BLOCKS + start) / 2;
+    hi = (NUM_BLOCKS + end - 1) / 2;
+    for (len = 2; lo > 0; lo /= 2, hi /= 2, len *= 2)
+        for (node = lo; node <= hi; node++)
+            ext_pull(node, len);
+    pthread_mutex_unlock(&ext_lock);
+}
+
+void ext_rebuild() {
+    uint32_t i, node, len, level;
+
+    pthread_mutex_lock(&ext_lock);
+    for (i = 0; i < NUM_BLOCKS; i++) {
+        len = (free_bit_map[i/8] >> (i % 8)) & 1;
+        node = NUM_BLOCKS + i;
+        ext_tree[node].pre = ext_tree[node].suf = ext_tree[node].best = len;
+    }
+    for (level = NUM_BLOCKS / 2, len = 2; level > 0; level /= 2, len *= 2)
+        for (node = level; node < 2 * level; node++)
+            ext_pull(node, len);
+    pthread_mutex_unlock(&ext_lock);
+}
+
+// Finds the first run of n free blocks that starts at or after from. l and r
+// bound the range covered by node, and carry is the length of the free run
+// ending just before l (counting only blocks at or after from). Subtrees with
+// no long enough run are stepped over using their summary, so only the nodes
+// along the path to from and the path to the answer are visited.
+static int ext_search(uint32_t node, uint32_t l, uint32_t r, uint32_t from,
+                      uint32_t n, uint32_t *carry) {
+    ext_node_t *e = &ext_tree[node];
+    int res;
+
+    if (r <= from) return -1;
+    if (l >= from) {
+        if (*carry + e->pre >= n) return l - *carry;
+        if (e->best < n) {
+            *carry = e->pre == r - l ? *carry + (r - l) : e->suf;
+            return -1;
+        }
+    }
+    if (r - l == 1) {
+        *carry = 0;
+        return -1;
+    }
+    res = ext_search(2*node, l, (l + r) / 2, from, n, carry);
+    if (res != -1) return res;
+    return ext_search(2*node + 1, (l + r) / 2, r, from, n, carry);
+}
+
+uint32_t largest_run() {
+    return ext_tree[1].best;
+}
 
 void force_set_index(uint32_t index) {
     // TODO
     // Used to force indicies for superblock and others
     uint32_t i = index/8;
     uint8_t bit = index % 8;
-    USE_BIT( free_bit_map[i], bit );
+    (void) USE_BIT( free_bit_map[i], bit );
+    ext_sync(index);
 }
 
 
 uint32_t get_index() {
     uint32_t i = 0;
+    uint8_t data;
+
+    for (;;) {
+        // find the first section with a free bit
+        // let's ignore overflow for now...
+        // I edited this to check for overflow
+        while (i < SIZE && __atomic_load_n(&free_bit_map[i], __ATOMIC_RELAXED) == 0) { i++; }
+        if (i == SIZE) return NUM_BLOCKS;
+
+        // now, find the first free bit
+        // ffs has the lsb as 1, not 0. So we need to subtract
+        data = __atomic_load_n(&free_bit_map[i], __ATOMIC_RELAXED);
+        if (data == 0) continue;
+        uint8_t bit = ffs(data) - 1;
+
+        // set the bit to used; if another thread beat us to it, look again
+        if (USE_BIT(free_bit_map[i], bit)) {
+            ext_sync(i*8 + bit);
+            //return which bit we used
+            return i*8 + bit;
+        }
+    }
+}
+
+// Claims the first free block in [start, end) without updating the free
+// extent index, so that a caller taking several blocks can do that once.
+static uint32_t claim_in(uint32_t start, uint32_t end) {
+    uint32_t index;
+
+    // skip whole bytes with no free bit, then look at the single bits
+    for (index = start; index < end; index++) {
+        uint8_t data = __atomic_load_n(&free_bit_map[index/8], __ATOMIC_RELAXED);
+        if (index % 8 == 0 && data == 0 && index + 8 <= end) {
+            index += 7;
+            continue;
+        }
+        if ((data & (1 << (index % 8))) && USE_BIT(free_bit_map[index/8], index % 8))
+            return index;
+    }
+    return NUM_BLOCKS;
+}
+
+uint32_t get_index_in(uint32_t start, uint32_t end) {
+    uint32_t index = claim_in(start, end);
+
+    ext_sync(index);
+    return index;
+}
+
+uint32_t get_run(uint32_t start, uint32_t end, uint32_t n) {
+    uint32_t carry, i;
+    int found;
+
+    if (n == 0) return NUM_BLOCKS;
+    for (;;) {
+        carry = 0;
+        pthread_mutex_lock(&ext_lock);
+        found = ext_search(1, 0, NUM_BLOCKS, start, n, &carry);
+        pthread_mutex_unlock(&ext_lock);
+        if (found == -1 || found + n > end) return NUM_BLOCKS;
+
+        // claim the run; if another thread took one of its blocks in the
+        // meantime, give back what we got and search again
+        for (i = 0; i < n; i++)
+            if (!USE_BIT(free_bit_map[(found + i)/8], (found + i) % 8)) break;
+        if (i == n) {
+            ext_sync_range(found, found + n);
+            return found;
+        }
+        while (i > 0) {
+            i--;
+            FREE_BIT(free_bit_map[(found + i)/8], (found + i) % 8);
+        }
+    }
+}
+
+void resv_reset() {
+    __atomic_fetch_add(&resv_gen, 1, __ATOMIC_RELEASE);
+    memset(resv_bit_map, 0, SIZE);
+    resv_pool.n = 0;
+}
 
-    // find the first section with a free bit
-    // let's ignore overflow for now...
-    // I edited this to check for overflow
-    while (free_bit_map[i] == 0 && i < SIZE ) { i++; }
+// Drops the calling thread's pool if it was filled before the last
+// resv_reset().
+static void resv_check_gen() {
+    if (resv_pool.n > 0 &&
+        resv_pool.gen != __atomic_load_n(&resv_gen, __ATOMIC_ACQUIRE))
+        resv_pool.n = 0;
+}
 
-    // now, find the first free bit
-    // ffs has the lsb as 1, not 0. So we need to subtract
-    uint8_t bit = ffs(free_bit_map[i]) - 1;
+void flush_reservation() {
+    uint32_t index, lo = NUM_BLOCKS, hi = 0;
 
-    // set the bit to used
-    USE_BIT(free_bit_map[i], bit);
+    resv_check_gen();
 
-    //return which bit we used
-    return i*8 + bit;
+    while (resv_pool.n > 0) {
+        resv_pool.n--;
+        index = resv_pool.blks[resv_pool.n];
+        // free the block before dropping the reservation, so that it is
+        // always free in at least one of the two maps
+        FREE_BIT(free_bit_map[index/8], index % 8);
+        __atomic_fetch_and(&resv_bit_map[index/8], (uint8_t)~(1 << (index % 8)),
+                           __ATOMIC_RELEASE);
+        if (index < lo) lo = index;
+        if (index >= hi) hi = index + 1;
+    }
+    ext_sync_range(lo, hi);
+}
+
+uint32_t get_index_reserved(uint32_t start, uint32_t end) {
+    uint32_t i, index;
+
+    resv_check_gen();
+    if (resv_pool.n > 0 && (resv_pool.start != start || resv_pool.end != end))
+        flush_reservation();
+
+    // refill the pool, preferably with one contiguous run so that a thread
+    // writing a file sequentially lays it out contiguously, and otherwise with
+    // one pass over the range. The blocks are stored in reverse so that they
+    // are handed out in increasing order.
+    if (resv_pool.n == 0) {
+        uint32_t got[RESV_CHUNK];
+        uint32_t n = 0;
+        index = get_run(start, end, RESV_CHUNK);
+        if (index != NUM_BLOCKS) {
+            for (n = 0; n < RESV_CHUNK; n++) got[n] = index + n;
+        } else {
+            // the blocks are claimed in increasing order, and the extent
+            // index is brought up to date once for all of them
+            index = start;
+            while (n < RESV_CHUNK) {
+                index = claim_in(index, end);
+                if (index == NUM_BLOCKS) break;
+                got[n++] = index++;
+            }
+            if (n > 0) ext_sync_range(got[0], got[n - 1] + 1);
+        }
+        for (i = 0; i < n; i++) {
+            resv_pool.blks[i] = got[n - 1 - i];
+            __atomic_fetch_or(&resv_bit_map[got[i]/8], (uint8_t)(1 << (got[i] % 8)),
+                              __ATOMIC_RELEASE);
+        }
+        resv_pool.n = n;
+        resv_pool.start = start;
+        resv_pool.end = end;
+        resv_pool.gen = __atomic_load_n(&resv_gen, __ATOMIC_ACQUIRE);
+        if (n == 0) return NUM_BLOCKS;
+    }
+    resv_pool.n--;
+    index = resv_pool.blks[resv_pool.n];
+    __atomic_fetch_and(&resv_bit_map[index/8], (uint8_t)~(1 << (index % 8)),
+                       __ATOMIC_RELEASE);
+    return index;
 }
 
 void rm_index(uint32_t index) {
@@ -87,9 +428,23 @@ void rm_index(uint32_t index) {
 
     // free bit
     FREE_BIT(free_bit_map[i], bit);
+    ext_sync(index);
 }
 
+void rm_run(uint32_t start, uint32_t n) {
+    uint32_t i = start, end = start + n;
 
-#endif //_INCLUDE_BITMAP_H_
+    while (i < end) {
+        if (i % 8 == 0 && i + 8 <= end) {
+            __atomic_fetch_or(&free_bit_map[i/8], UINT8_MAX, __ATOMIC_RELEASE);
+            i += 8;
+        } else {
+            FREE_BIT(free_bit_map[i/8], i % 8);
+            i++;
+        }
+    }
+    ext_sync_range(start, end);
+}
 
 
+#endif //_INCLUDE_BITMAP_H_
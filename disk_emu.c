@@ -1,15 +1,280 @@
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
 
 FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+int BLOCK_SIZE, MAX_BLOCK;
+
+/*Device model in use and the position the previous request left the head at.
+  model_set is set once the model has been chosen, by the environment on the
+  first mount or through the API, so that remounting keeps it.*/
+disk_model_t model;
+int model_set = 0;
+int head = 0;
+
+/*Number of requests currently being serviced, bounded by the queue depth*/
+int in_flight = 0;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/*Number of blocks transferred since the program started, across mounts*/
+unsigned long blks_read = 0, blks_written = 0;
+
+/*Trace ring buffer. trace_next counts every record ever added, so the
+  record it goes to is trace_next % trace_cap. trace_file is where the trace
+  is dumped on close_disk() when tracing was turned on by SFS_DISK_TRACE.*/
+disk_trace_rec_t *trace = NULL;
+uint64_t trace_cap = 0, trace_next = 0;
+struct timespec trace_t0;
+char *trace_file = NULL;
+static __thread int trace_tag = 0;
+
+/*Built-in device profiles, selectable by name with disk_set_profile() or the
+  SFS_DISK_PROFILE environment variable*/
+static const struct {
+    const char *name;
+    disk_model_t model;
+} profiles[] = {
+    /*No latency and no failures; the default, for functional tests*/
+    { "none",  { 0,     0,      0,   0,     0,  0,    3 } },
+    /*Flash: flat access time, ~500MB/s, many requests in flight*/
+    { "ssd",   { 20,    0.002,  0,   0,     32, 0,    3 } },
+    /*Rotating disk: ~120MB/s, seeks up to 8ms, one request at a time*/
+    { "hdd",   { 100,   0.008,  8,   8000,  1,  0,    3 } },
+    /*Flash that fails 1% of block transfers*/
+    { "flaky", { 20,    0.002,  0,   0,     32, 0.01, 3 } },
+};
+
+/*----------------------------------------------------------*/
+/*Selects one of the built-in device profiles by name        */
+/*----------------------------------------------------------*/
+int disk_set_profile(const char *name)
+{
+    int i;
+    for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        if (strcmp(profiles[i].name, name) == 0)
+        {
+            model = profiles[i].model;
+            model_set = 1;
+            return 0;
+        }
+    }
+    printf("Unknown disk profile %s\n", name);
+    return -1;
+}
+
+void disk_set_model(const disk_model_t *m)
+{
+    model = *m;
+    model_set = 1;
+}
+
+void disk_get_model(disk_model_t *m)
+{
+    *m = model;
+}
+
+/*----------------------------------------------------------*/
+/*Reports the number of blocks successfully read and written */
+/*since the program started                                  */
+/*----------------------------------------------------------*/
+void disk_get_counters(unsigned long *nread, unsigned long *nwritten)
+{
+    *nread = __atomic_load_n(&blks_read, __ATOMIC_RELAXED);
+    *nwritten = __atomic_load_n(&blks_written, __ATOMIC_RELAXED);
+}
+
+/*------------------------------------------------------------------*/
+/*Starts recording block requests in a ring buffer holding the last  */
+/*capacity requests. Restarting drops the records kept so far.       */
+/*------------------------------------------------------------------*/
+int disk_trace_start(int capacity)
+{
+    disk_trace_rec_t *buf;
+
+    if (capacity <= 0)
+        return -1;
+    buf = calloc(capacity, sizeof(disk_trace_rec_t));
+    if (buf == NULL)
+        return -1;
+    disk_trace_stop();
+    clock_gettime(CLOCK_MONOTONIC, &trace_t0);
+    trace_next = 0;
+    trace_cap = capacity;
+    __atomic_store_n(&trace, buf, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void disk_trace_stop()
+{
+    disk_trace_rec_t *buf = __atomic_exchange_n(&trace, NULL, __ATOMIC_ACQ_REL);
+    free(buf);
+}
+
+/*Sets the tag recorded with the requests made by the calling thread*/
+void disk_set_tag(int tag)
+{
+    trace_tag = tag;
+}
+
+static void trace_add(int op, int start_address, int nblocks)
+{
+    disk_trace_rec_t *buf = __atomic_load_n(&trace, __ATOMIC_ACQUIRE);
+    disk_trace_rec_t *rec;
+    struct timespec t;
+    uint64_t i;
+
+    if (buf == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    i = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    rec = &buf[i % trace_cap];
+    rec->ts_us = (t.tv_sec - trace_t0.tv_sec) * 1000000ULL
+                 + (t.tv_nsec - trace_t0.tv_nsec) / 1000;
+    rec->start = start_address;
+    rec->nblocks = nblocks;
+    rec->op = op;
+    rec->tag = trace_tag;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes the records in the ring buffer to filename, oldest first.   */
+/*Tracing must not be running concurrently with the dump.            */
+/*------------------------------------------------------------------*/
+int disk_trace_dump(const char *filename)
+{
+    disk_trace_hdr_t hdr;
+    uint64_t first, i;
+    FILE *out;
+
+    if (trace == NULL)
+        return -1;
+    out = fopen(filename, "wb");
+    if (out == NULL)
+    {
+        printf("Could not create trace file %s\n", filename);
+        return -1;
+    }
+    first = trace_next > trace_cap ? trace_next - trace_cap : 0;
+    hdr.magic = DISK_TRACE_MAGIC;
+    hdr.version = DISK_TRACE_VERSION;
+    hdr.block_size = BLOCK_SIZE;
+    hdr.num_blocks = MAX_BLOCK;
+    hdr.count = trace_next - first;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    for (i = first; i < trace_next; i++)
+        fwrite(&trace[i % trace_cap], sizeof(disk_trace_rec_t), 1, out);
+    fclose(out);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Sets up the device model from the environment. SFS_DISK_PROFILE    */
+/*picks a built-in profile and the other variables override single   */
+/*parameters of it. A model already chosen is kept.                  */
+/*------------------------------------------------------------------*/
+static void init_model()
+{
+    char *v;
+
+    head = 0;
+    if (!model_set)
+    {
+        disk_set_profile("none");
+        if ((v = getenv("SFS_DISK_PROFILE")) != NULL)
+            disk_set_profile(v);
+        if ((v = getenv("SFS_DISK_LATENCY_US")) != NULL)
+            model.op_latency_us = atof(v);
+        if ((v = getenv("SFS_DISK_US_PER_BYTE")) != NULL)
+            model.us_per_byte = atof(v);
+        if ((v = getenv("SFS_DISK_SEEK_US_PER_BLK")) != NULL)
+            model.seek_us_per_blk = atof(v);
+        if ((v = getenv("SFS_DISK_MAX_SEEK_US")) != NULL)
+            model.max_seek_us = atof(v);
+        if ((v = getenv("SFS_DISK_QUEUE_DEPTH")) != NULL)
+            model.queue_depth = atoi(v);
+        if ((v = getenv("SFS_DISK_FAIL_PROB")) != NULL)
+            model.fail_prob = atof(v);
+        if ((v = getenv("SFS_DISK_MAX_RETRY")) != NULL)
+            model.max_retry = atoi(v);
+    }
+
+    /*SFS_DISK_TRACE names the file the trace is dumped to when the disk is
+      closed. The ring buffer is kept across remounts.*/
+    if ((v = getenv("SFS_DISK_TRACE")) != NULL && trace == NULL)
+    {
+        trace_file = v;
+        disk_trace_start(getenv("SFS_DISK_TRACE_SIZE") != NULL ?
+                         atoi(getenv("SFS_DISK_TRACE_SIZE")) : 65536);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Waits for a free queue slot, then pauses for the modelled service  */
+/*time of a request for nblocks blocks at start_address. The pause  */
+/*happens outside the lock so that up to queue_depth requests can be */
+/*in service at once.                                                */
+/*------------------------------------------------------------------*/
+static void begin_request(int start_address, int nblocks)
+{
+    double us, seek;
+    struct timespec ts;
+
+    pthread_mutex_lock(&queue_lock);
+    while (model.queue_depth > 0 && in_flight >= model.queue_depth)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    in_flight++;
+    seek = model.seek_us_per_blk * abs(start_address - head);
+    if (model.max_seek_us > 0 && seek > model.max_seek_us)
+        seek = model.max_seek_us;
+    head = start_address + nblocks;
+    pthread_mutex_unlock(&queue_lock);
+
+    /*Pause until the latency duration is elapsed*/
+    us = model.op_latency_us + seek + model.us_per_byte * nblocks * BLOCK_SIZE;
+    if (us > 0)
+    {
+        ts.tv_sec = (time_t)(us / 1e6);
+        ts.tv_nsec = (long)((us - ts.tv_sec * 1e6) * 1e3);
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void end_request()
+{
+    pthread_mutex_lock(&queue_lock);
+    in_flight--;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Returns 1 if the transfer of one block fails after all retries.    */
+/*Each retry costs another op_latency_us.                            */
+/*------------------------------------------------------------------*/
+static int transfer_fails()
+{
+    int attempt;
+    struct timespec ts;
+
+    if (model.fail_prob <= 0)
+        return 0;
+    for (attempt = 0; attempt <= model.max_retry; attempt++)
+    {
+        if ((double)rand() / RAND_MAX >= model.fail_prob)
+            return 0;
+        ts.tv_sec = 0;
+        ts.tv_nsec = (long)(model.op_latency_us * 1e3);
+        nanosleep(&ts, NULL);
+    }
+    return 1;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
@@ -19,7 +284,10 @@ int close_disk()
     if(NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
     }
+    if (trace_file != NULL)
+        disk_trace_dump(trace_file);
     return 0;
 }
 
@@ -29,17 +297,12 @@ int close_disk()
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
     int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+
+    init_model();
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
+
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     /*Creates a new file*/
@@ -50,7 +313,7 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
-    
+
     /*Fills the file with 0's to its given size*/
     for (i = 0; i < MAX_BLOCK; i++)
     {
@@ -59,6 +322,7 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
             fputc(0, fp);
         }
     }
+    fflush(fp);
     return 0;
 }
 /*----------------------------*/
@@ -66,19 +330,14 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    init_model();
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
+
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
-    
+
     /*Opens a file*/
     fp = fopen (filename, "r+b");
 
@@ -95,13 +354,10 @@ int init_disk(char *filename, int block_size, int num_blocks)
 /*-------------------------------------------------------------------*/
 int read_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, j, e, s;
+    int i, e, s;
     e = 0;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
@@ -109,32 +365,32 @@ int read_blocks(int start_address, int nblocks, void *buffer)
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    trace_add(DISK_TRACE_READ, start_address, nblocks);
+    begin_request(start_address, nblocks);
 
-    /*For every block requested*/
+    /*For every block requested. pread() takes the offset explicitly, so
+      requests from several threads can be serviced at the same time.*/
     for (i = 0; i < nblocks; ++i)
     {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
-
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-
-       for (j = 0; j < BLOCK_SIZE; j++)
+        if (transfer_fails())
         {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+            /*Skip over the block, leaving the buffer untouched*/
+            e++;
+            continue;
         }
+        s++;
+        pread(fileno(fp), buffer + (i*BLOCK_SIZE), BLOCK_SIZE,
+              (off_t)(start_address + i) * BLOCK_SIZE);
     }
 
-    free(blockRead);
-
+    end_request();
+    __atomic_fetch_add(&blks_read, s, __ATOMIC_RELAXED);
 
     /*If no failure return the number of blocks read, else return the negative number of failures*/
     if (e == 0)
         return s;
     else
-        return e;
+        return -e;
 }
 
 /*------------------------------------------------------------------*/
@@ -146,8 +402,6 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     e = 0;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
@@ -155,26 +409,29 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    trace_add(DISK_TRACE_WRITE, start_address, nblocks);
+    begin_request(start_address, nblocks);
 
-    /*For every block requested*/        
+    /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
+        if (transfer_fails())
+        {
+            /*Leave the block on disk as it was*/
+            e++;
+            continue;
+        }
+        pwrite(fileno(fp), buffer + (i*BLOCK_SIZE), BLOCK_SIZE,
+               (off_t)(start_address + i) * BLOCK_SIZE);
         s++;
     }
-    free(blockWrite);
+
+    end_request();
+    __atomic_fetch_add(&blks_written, s, __ATOMIC_RELAXED);
 
     /*If no failure return the number of blocks written, else return the negative number of failures*/
     if (e == 0)
         return s;
     else
-        return e;
+        return -e;
 }
@@ -1,5 +1,58 @@
+#include <stdint.h>
+
+/*Performance model of the emulated device. Every read_blocks() or
+  write_blocks() call costs op_latency_us, plus seek_us_per_blk for every block
+  between the end of the previous request and the start of this one (capped at
+  max_seek_us), plus us_per_byte for every byte transferred. At most
+  queue_depth requests are serviced at the same time; further callers wait.
+  Each block transfer fails with probability fail_prob and is retried up to
+  max_retry times before the call reports it as failed.*/
+typedef struct {
+    double op_latency_us;
+    double us_per_byte;
+    double seek_us_per_blk;
+    double max_seek_us;
+    int queue_depth;
+    double fail_prob;
+    int max_retry;
+} disk_model_t;
+
+/*Trace of block requests. When tracing is on, every read_blocks() and
+  write_blocks() call is appended to a ring buffer that keeps the most recent
+  records. A dump is a disk_trace_hdr_t followed by count records, oldest
+  first. The tag is whatever the caller last passed to disk_set_tag() on the
+  same thread; its meaning is up to the caller.*/
+#define DISK_TRACE_MAGIC 0x54534653
+#define DISK_TRACE_VERSION 1
+#define DISK_TRACE_READ 'R'
+#define DISK_TRACE_WRITE 'W'
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t num_blocks;
+    uint64_t count;
+} disk_trace_hdr_t;
+
+typedef struct {
+    uint64_t ts_us;
+    uint32_t start;
+    uint16_t nblocks;
+    uint8_t op;
+    uint8_t tag;
+} disk_trace_rec_t;
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+int disk_set_profile(const char *name);
+void disk_set_model(const disk_model_t *model);
+void disk_get_model(disk_model_t *model);
+void disk_get_counters(unsigned long *nread, unsigned long *nwritten);
+int disk_trace_start(int capacity);
+void disk_trace_stop();
+int disk_trace_dump(const char *filename);
+void disk_set_tag(int tag);
@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 30
+#define FUSE_USE_VERSION 26
 
 #include <fuse.h>
 #include <stdio.h>
@@ -13,20 +13,58 @@
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/* Read-only virtual file holding the output of sfs_format_stats(). It is not
+ * stored on the disk and does not show up in directory listings. */
+#define STATS_PATH "/.sfs_stats"
+#define STATS_MAX 8192
+
+/* Set by --ro, which mounts the existing disk read-only. Nothing on it can
+ * change while it is mounted, so the kernel is told to keep file pages,
+ * attributes and lookups cached for as long as it likes, and reads go through
+ * sfs_pread(), which takes no lock on such a volume, so that the FUSE worker
+ * threads serve them in parallel. */
+#define RO_OPTS "ro,kernel_cache,entry_timeout=86400,attr_timeout=86400," \
+                "negative_timeout=86400"
+
+/* Used for a normal read-write mount. The FUSE layer is the only writer, so
+ * lookups and attributes can be cached for a while; auto_cache keeps the page
+ * cache of a file across opens for as long as its size and mtime stay the
+ * same, and drops it when they change. big_writes lets the kernel hand over up
+ * to MAX_WRITE bytes per write instead of a page at a time. */
+#define MAX_WRITE 131072
+#define RW_OPTS "auto_cache,entry_timeout=60,attr_timeout=60," \
+                "negative_timeout=60,big_writes,max_write=131072"
+
+static int read_only;
+
+static int is_stats(const char *path)
+{
+    return strcmp(path, STATS_PATH) == 0;
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
     int size;
+    uint64_t mtime;
     
     memset(stbuf, 0, sizeof(struct stat));
     
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-    } else if((size = sfs_GetFileSize(path)) != -1) {
-        stbuf->st_mode = S_IFREG | 0666;
+    } else if (is_stats(path)) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = sfs_format_stats(NULL, 0);
+    } else if((size = sfs_getfilesize(path)) != -1) {
+        mtime = sfs_getmtime(path);
+        stbuf->st_mode = S_IFREG | (read_only ? 0444 : 0666);
         stbuf->st_nlink = 1;
         stbuf->st_size = size;
+        stbuf->st_mtim.tv_sec = mtime / 1000000000;
+        stbuf->st_mtim.tv_nsec = mtime % 1000000000;
+        stbuf->st_ctim = stbuf->st_mtim;
     } else
         res = -ENOENT;
     
@@ -44,7 +82,7 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     
-    while(sfs_get_next_filename(file_name)) {
+    while(sfs_getnextfilename(file_name)) {
         filler(buf, &file_name[1], NULL, 0);
     }
     
@@ -56,6 +94,8 @@ static int fuse_unlink(const char *path)
     int res;
     char filename[MAXFILENAME];
     
+    if (is_stats(path))
+        return -EACCES;
     strcpy(filename, path);
     res = sfs_remove(filename);
     if (res == -1)
@@ -69,6 +109,14 @@ static int fuse_open(const char *path, struct fuse_file_info *fi)
     int res;
     char filename[MAXFILENAME];
     
+    /* The statistics change between reads, so bypass the page cache and
+     * don't trust the size reported by getattr. */
+    if (is_stats(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        fi->direct_io = 1;
+        return 0;
+    }
     strcpy(filename, path);
     
     res = sfs_fopen(filename);
@@ -82,25 +130,30 @@ static int fuse_open(const char *path, struct fuse_file_info *fi)
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
     char filename[MAXFILENAME];
     
+    if (is_stats(path)) {
+        char stats[STATS_MAX];
+        int len = sfs_format_stats(stats, sizeof(stats));
+        if (len > sizeof(stats) - 1)
+            len = sizeof(stats) - 1;
+        if (offset >= len)
+            return 0;
+        if (offset + size > len)
+            size = len - offset;
+        memcpy(buf, stats + offset, size);
+        return size;
+    }
     strcpy(filename, path);
     
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
+    /* Several threads may be reading the same file, and sfs_fopen() would
+     * give them all the same descriptor and position. */
+    res = sfs_pread(filename, offset, buf, size);
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(fd);
     return res;
 }
 
@@ -112,6 +165,8 @@ static int fuse_write(const char *path, const char *buf, size_t size,
     
     char filename[MAXFILENAME];
     
+    if (is_stats(path))
+        return -EACCES;
     strcpy(filename, path);
     
     fd = sfs_fopen(filename);
@@ -123,7 +178,7 @@ static int fuse_write(const char *path, const char *buf, size_t size,
     
     res = sfs_fwrite(fd, buf, size);
     if (res == -1)
-        return -errno;
+        res = -errno;
     
     sfs_fclose(fd);
     return res;
@@ -132,15 +187,21 @@ static int fuse_write(const char *path, const char *buf, size_t size,
 static int fuse_truncate(const char *path, off_t size)
 {
     char filename[MAXFILENAME];
-    int fd;
+    int fd, res;
     
+    if (is_stats(path))
+        return -EACCES;
     strcpy(filename, path);
     
-    fd = sfs_remove(filename);
+    fd = sfs_fopen(filename);
     if (fd == -1)
         return -errno;
     
-    fd = sfs_fopen(filename);
+    if (sfs_ftruncate(fd, size) == -1) {
+        res = -errno;
+        sfs_fclose(fd);
+        return res;
+    }
     sfs_fclose(fd);
     return 0;
 }
@@ -162,11 +223,28 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     
     strcpy(filename, path);
     fd = sfs_fopen(filename);
+    if (fd == -1)
+        return -errno;
     
     sfs_fclose(fd);
     return 0;
 }
 
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+#ifdef FUSE_CAP_BIG_WRITES
+    conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+    if (conn->max_write < MAX_WRITE)
+        conn->max_write = MAX_WRITE;
+    return NULL;
+}
+
+static void fuse_destroy(void *private_data)
+{
+    sfs_unmount();
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
@@ -178,11 +256,30 @@ static struct fuse_operations xmp_oper = {
     .write = fuse_write, 
     .access = fuse_access,
     .create = fuse_create,
+    .init = fuse_init,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
 {
-    mksfs(1);
+    char *args[argc + 2];
+    int i, n = 0;
+    
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--ro") == 0)
+            read_only = 1;
+        else
+            args[n++] = argv[i];
+    }
+    if (read_only) {
+        args[n++] = "-o";
+        args[n++] = RO_OPTS;
+        mksfs_ro();
+    } else {
+        args[n++] = "-o";
+        args[n++] = RW_OPTS;
+        mksfs(1);
+    }
     
-    return fuse_main(argc, argv, &xmp_oper, NULL);
+    return fuse_main(n, args, &xmp_oper, NULL);
 }
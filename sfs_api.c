@@ -10,21 +10,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include "sfs_api.h"
+#include "sfs_layout.h"
 #include "bitmap.h"
+#include "disk_emu.h"
+#include "sfs_crc.h"
 
 
-// Define the name of the disk, block size, number of blocks, number of inodes,
-// and the number of blocks storing the inodes. These may be changed.
-#define DISK_NAME "test_disk.disk"
-#define BLOCK_SIZE 1024
-#define NUM_BLOCKS 100
-#define NUM_INODES 10
-#define NUM_INODE_BLOCKS ( sizeof( inode_t ) * NUM_INODES/BLOCK_SIZE + 1 )
-#define NO_DIR_BLKS ( sizeof( dir_entry_t ) * NUM_INODES/BLOCK_SIZE + 1 )
-#define MAX_FILE_SIZE \
-    ( 12 * BLOCK_SIZE + BLOCK_SIZE/sizeof( unsigned int ) * BLOCK_SIZE )
-#define MAGIC_NUM 0xABCD0005
 #define reset_buf(buf) { int i; for( i = 0; i < BLOCK_SIZE; i++ ) buf[i] = 0; }
 
 
@@ -33,23 +28,750 @@
 // file descriptor table. The in-memory free bitmap was declared in the bitmap.h
 // header file and is stored there. 
 // An index into the in-memory directory cache is also maintained as a global
-// variable for functions such as sfs_getnextfilename()
+// variable for functions such as sfs_getnextfilename(). The inode table has one
+// slot more than the disk, SNAP_INO, which is never written out (see below).
 super_block_t sb;
-inode_t table[NUM_INODES];
+inode_t table[NUM_INODES + 1];
 file_descriptor_t fdt[NUM_INODES - 1];
 uint8_t glb_buf[BLOCK_SIZE];
 dir_entry_t mem_dir[NUM_INODES - 1];
 int dir_i = 0;
 
+// The in-memory directory is indexed by a hash table from file names to their
+// slots, chained through dir_next, so that looking a name up costs the same
+// however full the directory is. Slots are stored plus one, so that 0 ends a
+// chain. The index is rebuilt whenever the directory is loaded.
+#define DIR_BUCKETS 64
+int dir_head[DIR_BUCKETS];
+int dir_next[NUM_INODES - 1];
+
+// The time each file was last changed, in nanoseconds since the epoch, for
+// sfs_getmtime(). The inode has no room for it, so it is only kept in memory
+// and files that have not changed since the mount report the mount time.
+uint64_t mtimes[NUM_INODES];
+
+// Mount state. The free bitmap slices and the directory are only read from the
+// disk the first time they are needed, so mounting a cleanly unmounted volume
+// only reads the super block and the inode tables. grp_loaded, bitmap_dirty
+// and inode_dirty are bit masks with one bit per block group. counters_valid
+// records whether the free space summary in the super block can be trusted,
+// and sb_dirty whether the on-disk super block has already been marked as not
+// cleanly unmounted. dir_dirty has a bit per directory block that failed to be
+// written.
+uint32_t grp_loaded = 0;
+uint32_t bitmap_dirty = 0;
+uint32_t inode_dirty = 0;
+uint32_t dir_dirty = 0;
+int dir_loaded = 0;
+int counters_valid = 0;
+int sb_dirty = 0;
+
+// Block allocation may be called from several threads at once. Bits in the
+// bitmap are flipped atomically, blocks are handed out from per-thread pools
+// in bitmap.h, and the counters and dirty masks are updated atomically;
+// grp_lock only serializes the first load of a group's bitmap slice. The free
+// extent index behind the bitmap is guarded by ext_lock, which the pools take
+// once per RESV_CHUNK blocks. The public calls all hold fs_lock, so today
+// this only matters for the reclaimer and for internal callers.
+pthread_mutex_t grp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Removing a file only flags its inode INODE_ORPHAN; a background reclaimer
+// started by mksfs() frees the blocks of orphans in batches. Every public call
+// holds fs_lock while it runs, as does the reclaimer while it works, so the
+// two never see each other's half-finished updates. orphan_cnt counts the
+// orphans the reclaimer has not got to yet.
+#define RECLAIM_DELAY_MS 5
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+pthread_t reclaim_thread;
+int reclaim_running = 0;
+int reclaim_stop = 0;
+int orphan_cnt = 0;
+void reclaim_orphans();
+void start_reclaimer();
+void stop_reclaimer();
+void release_reservations();
+
+// Set by mksfs_ro(). Nothing on a read-only volume changes once it is mounted,
+// and the mount loads the directory and reference tables up front, so
+// sfs_pread(), sfs_getfilesize() and sfs_getmtime() run without fs_lock and
+// the calls that would change the volume fail with EROFS. sfs_fread() still
+// takes the lock: sfs_fopen() gives every opener of a file the same
+// descriptor, and the read moves its shared position. mount_gen counts mounts,
+// so that the per-thread caches of readers can tell when their contents came
+// from an earlier one.
+int read_only = 0;
+int mount_gen = 0;
+
+// A copy of the indirect block used last, so that a pass over a large file
+// reads its indirect block once rather than once per data block. ind_addr is 0
+// when nothing is cached, and the copy is dropped when its block is freed.
+// ind_dirty is set while the copy has failed to be written to its block.
+uint32_t ind_addr = 0;
+int ind_dirty = 0;
+unsigned int ind_cache[BLOCK_SIZE/sizeof( unsigned int )];
+__thread int ro_ind_gen = 0;
+__thread uint32_t ro_ind_addr = 0;
+__thread unsigned int ro_ind_cache[BLOCK_SIZE/sizeof( unsigned int )];
+
+// The codecs by id and the one that files created from now on are compressed
+// with.
+const sfs_codec_t *codecs[SFS_MAX_CODECS] = { NULL, &sfs_codec_lz };
+int cur_codec = SFS_CODEC_NONE;
+
+// An unpacked copy of the cluster of a compressed file used last. clu_len is
+// how many of its bytes are file data and clu_map which of its blocks hold
+// data, so that holes stay holes when it is stored as is. Writes change the
+// copy and then store it with flush_cluster(), which is where it is packed;
+// reads of the same cluster are served from it without unpacking it again.
+// clu_ino is 0 when nothing is cached.
+#define CLUSTER_BYTES ( CLUSTER_BLKS * BLOCK_SIZE )
+int clu_ino = 0;
+int clu_idx = 0;
+int clu_len = 0;
+int clu_map = 0;
+int clu_dirty = 0;
+uint8_t clu_buf[CLUSTER_BYTES];
+
+// The same for each reader of a read-only volume, which only ever reads.
+__thread int ro_clu_gen = 0;
+__thread int ro_clu_ino = 0;
+__thread int ro_clu_idx = 0;
+__thread uint8_t ro_clu_buf[CLUSTER_BYTES];
+
+// The reference tables, loaded a group at a time on first use like the free
+// bitmap, and the dedup index: a hash table from the content hash of a block
+// to the blocks with REF_HASHED set, chained through ddx_next and filled in as
+// each group's table is loaded. While dedup is set, file data is written
+// through put_blk(). While csum_on is set, data blocks are checksummed as they
+// are written. Blocks that a write stops using are queued in dropped and only
+// released once the inode no longer pointing to them is on disk.
+#define DEDUP_BUCKETS 1024
+blk_ref_t refs[NUM_BLOCKS];
+uint32_t refs_loaded = 0;
+uint32_t refs_dirty = 0;
+uint32_t ddx_head[DEDUP_BUCKETS];
+uint32_t ddx_next[NUM_BLOCKS];
+int dedup = 0;
+int csum_on = 0;
+uint32_t dropped[NUM_BLOCKS];
+int ndropped = 0;
+
+// Set when a metadata block fails to be written. The structures it belongs to
+// stay dirty so that they are written again, and the API call that was running
+// fails with EIO (see meta_result()).
+int meta_err = 0;
+
+// The snapshot, if there is one (see sfs_layout.h). Its inodes share the data
+// blocks with the live files through the reference tables, so the live files
+// copy a block before writing to it. snap_table and snap_dir are loaded on
+// first use. The inode of the snapshot file being read is copied into
+// table[SNAP_INO] so that it can go through bmap() and read_clusters() like
+// any other; snap_cur says which one it is.
+#define SNAP_INO NUM_INODES
+inode_t snap_table[NUM_INODES];
+dir_entry_t snap_dir[NUM_INODES - 1];
+int snap_loaded = 0;
+int snap_cur = 0;
+int snap_dir_i = 0;
+
+// Instrumentation reported by sfs_get_stats(). The block counters of the disk
+// emulator count from the start of the program, so the values they had at the
+// last sfs_reset_stats() are kept to report the difference.
+sfs_stats_t stats;
+unsigned long base_blks_read = 0;
+unsigned long base_blks_written = 0;
+#define STAT_ADD(field, n) \
+    __atomic_fetch_add( &stats.field, ( n ), __ATOMIC_RELAXED )
+
+
+// Returns the trace tag of the metadata block at addr, going by its position in
+// its group.
+int meta_tag( int addr )
+{
+    int off = addr % BLKS_PER_GRP;
+    if ( off == 0 ) return SFS_TAG_SUPER;
+    if ( off == 1 ) return SFS_TAG_BITMAP;
+    if ( off < 2 + INODE_BLKS_PER_GRP ) return SFS_TAG_INODE;
+    if ( off < GRP_DATA_START ) return SFS_TAG_REFS;
+    if ( sb.snap_root != 0 && addr >= sb.snap_root && 
+         addr < sb.snap_root + SNAP_BLKS ) 
+        return SFS_TAG_SNAP;
+    return SFS_TAG_DIR;
+}
+
+
+// The disk emulator always transfers whole blocks, so reading or writing one of
+// the in-memory metadata structures directly would overrun it whenever it is
+// not a multiple of the block size. These helpers bounce the transfer through a
+// block-sized buffer and return the number of blocks transferred. A failed
+// write sets meta_err.
+int read_meta( int addr, void *dst, size_t len )
+{
+    int nblks = ( len + BLOCK_SIZE - 1 )/BLOCK_SIZE;
+    uint8_t *buf = calloc( nblks, BLOCK_SIZE );
+    disk_set_tag( meta_tag( addr ) );
+    int res = read_blocks( addr, nblks, buf );
+    memcpy( dst, buf, len );
+    free( buf );
+    return res;
+}
+
+
+int write_meta( int addr, const void *src, size_t len )
+{
+    int nblks = ( len + BLOCK_SIZE - 1 )/BLOCK_SIZE;
+    uint8_t *buf = calloc( nblks, BLOCK_SIZE );
+    memcpy( buf, src, len );
+    disk_set_tag( meta_tag( addr ) );
+    int res = write_blocks( addr, nblks, buf );
+    free( buf );
+    if ( res != nblks ) meta_err = 1;
+    return res;
+}
+
+
+// Writes the cached indirect block again if it failed to be written before.
+// @return 0 on success or -1 if it fails again.
+int flush_indirect()
+{
+    if ( !ind_dirty || ind_addr == 0 ) return 0;
+    disk_set_tag( SFS_TAG_INDIRECT );
+    if ( write_blocks( ind_addr, 1, ind_cache ) != 1 ) {
+        meta_err = 1;
+        return -1;
+    }
+    ind_dirty = 0;
+    return 0;
+}
+
+
+// Reads and writes indirect blocks through the single entry cache, or on a
+// read-only volume through the calling thread's own. A block that fails to
+// read is not kept in the cache. A cached block that failed to be written is
+// only given up once it has been written, and until then other blocks go
+// around the cache.
+void read_indirect( uint32_t addr, unsigned int *blk_indices )
+{
+    unsigned int *cache = read_only ? ro_ind_cache : ind_cache;
+    uint32_t *cached = read_only ? &ro_ind_addr : &ind_addr;
+    if ( read_only && ro_ind_gen != mount_gen ) {
+        ro_ind_addr = 0;
+        ro_ind_gen = mount_gen;
+    }
+    if ( addr != *cached ) {
+        STAT_ADD( cache_misses, 1 );
+        if ( flush_indirect() == -1 ) {
+            disk_set_tag( SFS_TAG_INDIRECT );
+            read_blocks( addr, 1, blk_indices );
+            return;
+        }
+        disk_set_tag( SFS_TAG_INDIRECT );
+        *cached = read_blocks( addr, 1, cache ) == 1 ? addr : 0;
+    } else {
+        STAT_ADD( cache_hits, 1 );
+    }
+    memcpy( blk_indices, cache, BLOCK_SIZE );
+}
+
+
+void write_indirect( uint32_t addr, const unsigned int *blk_indices )
+{
+    if ( addr != ind_addr && flush_indirect() == -1 ) {
+        disk_set_tag( SFS_TAG_INDIRECT );
+        if ( write_blocks( addr, 1, ( void * )blk_indices ) != 1 ) 
+            meta_err = 1;
+        return;
+    }
+    memcpy( ind_cache, blk_indices, BLOCK_SIZE );
+    ind_addr = addr;
+    disk_set_tag( SFS_TAG_INDIRECT );
+    ind_dirty = write_blocks( addr, 1, ind_cache ) != 1;
+    if ( ind_dirty ) meta_err = 1;
+}
+
+
+blk_ref_t *blk_ref( uint32_t blk );
+
+
+// Reads and writes n blocks of file contents, counting them as data blocks.
+// Blocks that have a checksum are checked against it as they are read, and a
+// mismatch fails the read. Writing a block gives it a new checksum while
+// csum_on is set and otherwise drops the one it had, which would no longer
+// match. The checksums reach the disk with the reference tables, at the end of
+// the call that wrote the blocks.
+// @return the number of blocks transferred, or -1 if any block could not be
+// read or a checksum is wrong. read_blocks() itself reports failed blocks as a
+// negative count, which callers would otherwise have to tell apart from -1.
+int read_data( uint32_t addr, int n, void *buf )
+{
+    int i, res;
+    blk_ref_t *r;
+    STAT_ADD( data_blks_read, n );
+    disk_set_tag( SFS_TAG_DATA );
+    if ( ( res = read_blocks( addr, n, buf ) ) != n ) return -1;
+    for ( i = 0; i < n; i++ ) {
+        r = blk_ref( addr + i );
+        if ( !( r -> flags & REF_CSUM ) || 
+             sfs_crc32c( 0, ( uint8_t * )buf + i * BLOCK_SIZE, BLOCK_SIZE ) == 
+             r -> crc ) 
+            continue;
+        STAT_ADD( csum_errors, 1 );
+        fprintf( stderr, "Checksum mismatch in block %u.\n", addr + i );
+        res = -1;
+    }
+    return res;
+}
+
+
+int write_data( uint32_t addr, int n, const void *buf )
+{
+    int i;
+    blk_ref_t *r;
+    STAT_ADD( data_blks_written, n );
+    disk_set_tag( SFS_TAG_DATA );
+    for ( i = 0; i < n; i++ ) {
+        r = blk_ref( addr + i );
+        if ( !csum_on && !( r -> flags & REF_CSUM ) ) continue;
+        if ( csum_on ) {
+            r -> crc = sfs_crc32c( 0, ( const uint8_t * )buf + i * BLOCK_SIZE,
+                                   BLOCK_SIZE );
+            r -> flags |= REF_CSUM;
+        } else {
+            r -> crc = 0;
+            r -> flags &= ~REF_CSUM;
+        }
+        refs_dirty |= 1 << BLK_GROUP( addr + i );
+    }
+    return write_blocks( addr, n, ( void * )buf ) == n ? n : -1;
+}
+
+
 // This function initializes the fields of the super block with the parameters
 // defined above.
 void init_super_block()
 {
+    memset( &sb, 0, sizeof( sb ) );
     sb.magic_num = MAGIC_NUM;
     sb.block_size =  BLOCK_SIZE;
     sb.fs_size = BLOCK_SIZE * NUM_BLOCKS;
-    sb.inode_table_len = NUM_INODE_BLOCKS;
+    sb.inode_table_len = INODE_BLKS_PER_GRP;
     sb.root_dir_inode = 0;
+    sb.num_groups = NUM_GROUPS;
+}
+
+
+// The first time the super block is about to be changed on disk after a mount,
+// the clean flag is cleared and written out so that a crash before
+// sfs_unmount() causes the next mount to distrust the checkpointed counters.
+void sb_mark_dirty()
+{
+    if ( sb_dirty ) return;
+    sb.clean = 0;
+    if ( write_meta( 0, &sb, sizeof( sb ) ) == 1 ) sb_dirty = 1;
+}
+
+
+// Rebuilds the free space summary by scanning the free bitmap and the inode
+// table. This is only needed after an unclean shutdown.
+void recount()
+{
+    int i;
+    for ( i = 0; i < NUM_GROUPS; i++ ) {
+        sb.grp_free_blks[i] = 0;
+        sb.grp_free_inodes[i] = 0;
+    }
+    for ( i = 0; i < NUM_BLOCKS; i++ )
+        if ( free_bit_map[i/8] & ( 1 << ( i % 8 ) ) )
+            sb.grp_free_blks[BLK_GROUP( i )]++;
+    for ( i = 1; i < NUM_INODES; i++ )
+        if ( table[i].link_cnt == 0 ) sb.grp_free_inodes[INODE_GROUP( i )]++;
+    sb.free_blk_cnt = 0;
+    sb.free_inode_cnt = 0;
+    for ( i = 0; i < NUM_GROUPS; i++ ) {
+        sb.free_blk_cnt += sb.grp_free_blks[i];
+        sb.free_inode_cnt += sb.grp_free_inodes[i];
+    }
+    counters_valid = 1;
+}
+
+
+// Loads the free bitmap slice of group g from the disk on first use.
+void load_grp_bitmap( int g )
+{
+    if ( __atomic_load_n( &grp_loaded, __ATOMIC_ACQUIRE ) & ( 1 << g ) ) return;
+    pthread_mutex_lock( &grp_lock );
+    if ( !( grp_loaded & ( 1 << g ) ) ) {
+        if ( read_meta( GRP_BITMAP_ADDR( g ), 
+                        free_bit_map + g * GRP_BITMAP_BYTES,
+                        GRP_BITMAP_BYTES ) != 1 )
+            die( "Incorrect number of blocks read to free bitmap.\n" );
+        ext_rebuild();
+        __atomic_fetch_or( &grp_loaded, 1 << g, __ATOMIC_RELEASE );
+    }
+    pthread_mutex_unlock( &grp_lock );
+}
+
+
+// Loads every bitmap slice and rebuilds the counters if the volume was not
+// cleanly unmounted.
+void load_bitmap()
+{
+    int g;
+    for ( g = 0; g < NUM_GROUPS; g++ ) load_grp_bitmap( g );
+    if ( !counters_valid ) recount();
+}
+
+
+// Allocates and frees data blocks through the free bitmap while keeping the
+// free space summary up to date. alloc_blk() searches the preferred group
+// first and then the following groups in turn, skipping any group the
+// summary says is full without loading its bitmap. Blocks come from the
+// calling thread's reservation pool, so the bitmap is searched and its
+// extent index updated only once every RESV_CHUNK allocations. It returns 0
+// when the disk is full; block 0 always holds the super block so it can never
+// be handed out. Before giving up, the blocks of removed files still waiting
+// for the reclaimer are freed on the spot.
+uint32_t alloc_blk( int grp )
+{
+    int i, g;
+    uint32_t blk;
+    if ( !counters_valid ) load_bitmap();
+    if ( sb.free_blk_cnt == 0 && orphan_cnt > 0 ) reclaim_orphans();
+    if ( __atomic_load_n( &sb.free_blk_cnt, __ATOMIC_RELAXED ) == 0 ) return 0;
+    for ( i = 0; i < NUM_GROUPS; i++ ) {
+        g = ( grp + i ) % NUM_GROUPS;
+        if ( __atomic_load_n( &sb.grp_free_blks[g], __ATOMIC_RELAXED ) == 0 )
+            continue;
+        load_grp_bitmap( g );
+        // Give back a pool taken from another group here rather than in
+        // get_index_reserved(), so that its group is marked dirty.
+        if ( resv_pool.n > 0 && resv_pool.start != GRP_BASE( g ) )
+            release_reservations();
+        blk = get_index_reserved( GRP_BASE( g ), GRP_BASE( g ) + BLKS_PER_GRP );
+        if ( blk == NUM_BLOCKS ) continue;
+        __atomic_fetch_sub( &sb.free_blk_cnt, 1, __ATOMIC_RELAXED );
+        __atomic_fetch_sub( &sb.grp_free_blks[g], 1, __ATOMIC_RELAXED );
+        __atomic_fetch_or( &bitmap_dirty, 1 << g, __ATOMIC_RELAXED );
+        return blk;
+    }
+    return 0;
+}
+
+
+// Allocates the block right after goal if it is free, so that a file being
+// extended stays contiguous on disk even when other files are written in
+// between, and falls back to alloc_blk() otherwise.
+uint32_t alloc_blk_near( int grp, uint32_t goal )
+{
+    if ( goal == 0 || goal + 1 >= NUM_BLOCKS ) return alloc_blk( grp );
+    load_grp_bitmap( BLK_GROUP( goal + 1 ) );
+    if ( !counters_valid ) load_bitmap();
+    if ( get_index_in( goal + 1, goal + 2 ) == NUM_BLOCKS ) 
+        return alloc_blk( grp );
+    __atomic_fetch_sub( &sb.free_blk_cnt, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_sub( &sb.grp_free_blks[BLK_GROUP( goal + 1 )], 1, 
+                        __ATOMIC_RELAXED );
+    __atomic_fetch_or( &bitmap_dirty, 1 << BLK_GROUP( goal + 1 ), 
+                       __ATOMIC_RELAXED );
+    return goal + 1;
+}
+
+
+// Allocates n contiguous blocks, preferring group grp, and returns the first
+// one, or 0 if no group has a long enough free run.
+uint32_t alloc_run( int grp, uint32_t n )
+{
+    int i, g;
+    uint32_t blk;
+    if ( !counters_valid ) load_bitmap();
+    for ( i = 0; i < NUM_GROUPS; i++ ) {
+        g = ( grp + i ) % NUM_GROUPS;
+        if ( __atomic_load_n( &sb.grp_free_blks[g], __ATOMIC_RELAXED ) < n )
+            continue;
+        load_grp_bitmap( g );
+        blk = get_run( GRP_BASE( g ), GRP_BASE( g ) + BLKS_PER_GRP, n );
+        if ( blk == NUM_BLOCKS ) continue;
+        __atomic_fetch_sub( &sb.free_blk_cnt, n, __ATOMIC_RELAXED );
+        __atomic_fetch_sub( &sb.grp_free_blks[g], n, __ATOMIC_RELAXED );
+        __atomic_fetch_or( &bitmap_dirty, 1 << g, __ATOMIC_RELAXED );
+        return blk;
+    }
+    if ( orphan_cnt > 0 ) {
+        reclaim_orphans();
+        return alloc_run( grp, n );
+    }
+    return 0;
+}
+
+
+// Adds blk to the dedup index, or takes it out of it, which also clears its
+// hash.
+void ddx_insert( uint32_t blk )
+{
+    int h = refs[blk].hash % DEDUP_BUCKETS;
+    ddx_next[blk] = ddx_head[h];
+    ddx_head[h] = blk;
+}
+
+
+void ddx_remove( uint32_t blk )
+{
+    uint32_t *p = &ddx_head[refs[blk].hash % DEDUP_BUCKETS];
+    while ( *p != 0 && *p != blk ) p = &ddx_next[*p];
+    if ( *p == blk ) *p = ddx_next[blk];
+    refs[blk].hash = 0;
+    refs[blk].flags &= ~REF_HASHED;
+    refs_dirty |= 1 << BLK_GROUP( blk );
+}
+
+
+// Loads the reference table of group g from the disk on first use and adds its
+// hashed blocks to the dedup index.
+void load_grp_refs( int g )
+{
+    int i;
+    if ( refs_loaded & ( 1 << g ) ) return;
+    if ( read_meta( GRP_REF_ADDR( g ), refs + GRP_BASE( g ), 
+                    BLKS_PER_GRP * sizeof( blk_ref_t ) ) != REF_BLKS_PER_GRP )
+        die( "Incorrect number of blocks read to reference table.\n" );
+    for ( i = GRP_BASE( g ); i < GRP_BASE( g ) + BLKS_PER_GRP; i++ )
+        if ( refs[i].flags & REF_HASHED ) ddx_insert( i );
+    refs_loaded |= 1 << g;
+}
+
+
+blk_ref_t *blk_ref( uint32_t blk )
+{
+    load_grp_refs( BLK_GROUP( blk ) );
+    return &refs[blk];
+}
+
+
+void persist_refs()
+{
+    int g;
+    for ( g = 0; g < NUM_GROUPS; g++ ) {
+        if ( !( refs_dirty & ( 1 << g ) ) ) continue;
+        sb_mark_dirty();
+        if ( write_meta( GRP_REF_ADDR( g ), refs + GRP_BASE( g ),
+                         BLKS_PER_GRP * sizeof( blk_ref_t ) ) != 
+             REF_BLKS_PER_GRP ) {
+            fprintf( stderr, "Failed to write reference table %d.\n", g );
+            continue;
+        }
+        refs_dirty &= ~( 1 << g );
+    }
+}
+
+
+void free_blk( uint32_t blk )
+{
+    int g = BLK_GROUP( blk );
+    if ( blk == ind_addr ) ind_addr = 0;
+    load_grp_bitmap( g );
+    rm_index( blk );
+    __atomic_fetch_add( &sb.free_blk_cnt, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &sb.grp_free_blks[g], 1, __ATOMIC_RELAXED );
+    __atomic_fetch_or( &bitmap_dirty, 1 << g, __ATOMIC_RELAXED );
+}
+
+
+int cmp_blk( const void *a, const void *b )
+{
+    uint32_t x = *( const uint32_t * )a, y = *( const uint32_t * )b;
+    return ( x > y ) - ( x < y );
+}
+
+
+// Frees a list of blocks, sorting it and coalescing it into runs so that each
+// run costs one update of the bitmap and the free extent index instead of one
+// per block. A block shared with other files only loses a reference, and a
+// block that is freed leaves the dedup index.
+void free_blks( uint32_t *blks, int cnt )
+{
+    int i, j, g, n = 0;
+    blk_ref_t *r;
+    for ( i = 0; i < cnt; i++ ) {
+        r = blk_ref( blks[i] );
+        if ( r -> refs > 0 ) {
+            r -> refs--;
+            refs_dirty |= 1 << BLK_GROUP( blks[i] );
+            continue;
+        }
+        if ( r -> flags & REF_HASHED ) ddx_remove( blks[i] );
+        if ( r -> flags & REF_CSUM ) {
+            r -> crc = 0;
+            r -> flags &= ~REF_CSUM;
+            refs_dirty |= 1 << BLK_GROUP( blks[i] );
+        }
+        blks[n++] = blks[i];
+    }
+    cnt = n;
+    qsort( blks, cnt, sizeof( uint32_t ), cmp_blk );
+    for ( i = 0; i < cnt; i = j ) {
+        g = BLK_GROUP( blks[i] );
+        for ( j = i + 1; j < cnt && blks[j] == blks[j - 1] + 1 && 
+                         BLK_GROUP( blks[j] ) == g; j++ );
+        if ( ind_addr >= blks[i] && ind_addr < blks[i] + ( j - i ) ) 
+            ind_addr = 0;
+        load_grp_bitmap( g );
+        rm_run( blks[i], j - i );
+        __atomic_fetch_add( &sb.free_blk_cnt, j - i, __ATOMIC_RELAXED );
+        __atomic_fetch_add( &sb.grp_free_blks[g], j - i, __ATOMIC_RELAXED );
+        __atomic_fetch_or( &bitmap_dirty, 1 << g, __ATOMIC_RELAXED );
+    }
+}
+
+
+// Returns the disk address of block b of the root directory, going through the
+// indirect block of the root inode when b is past the direct pointers.
+int dir_blk_addr( int b )
+{
+    if ( b < 12 ) return table[sb.root_dir_inode].blk_ptr[b];
+    unsigned int buf[BLOCK_SIZE/sizeof( unsigned int )];
+    read_indirect( table[sb.root_dir_inode].indirect, buf );
+    return buf[b - 12];
+}
+
+
+// Directory entries never straddle a block boundary; each directory block holds
+// DIR_PER_BLK entries followed by padding.
+void write_dir_blk( int b )
+{
+    int n = NUM_INODES - 1 - b * DIR_PER_BLK;
+    if ( n > DIR_PER_BLK ) n = DIR_PER_BLK;
+    sb_mark_dirty();
+    if ( write_meta( dir_blk_addr( b ), mem_dir + b * DIR_PER_BLK,
+                     n * sizeof( dir_entry_t ) ) == 1 ) 
+        dir_dirty &= ~( 1 << b );
+    else dir_dirty |= 1 << b;
+}
+
+
+// FNV-1a, folded onto the buckets of the directory index.
+int name_hash( const char *fname )
+{
+    uint32_t h = 2166136261u;
+    while ( *fname ) h = ( h ^ ( uint8_t )*fname++ ) * 16777619u;
+    return h % DIR_BUCKETS;
+}
+
+
+// Adds slot k of the directory to the index under the name it holds, and
+// takes it out again.
+void dir_link( int k )
+{
+    int b = name_hash( mem_dir[k].filename );
+    dir_next[k] = dir_head[b];
+    dir_head[b] = k + 1;
+}
+
+
+void dir_unlink( int k )
+{
+    int *p = &dir_head[name_hash( mem_dir[k].filename )];
+    while ( *p != k + 1 ) p = &dir_next[*p - 1];
+    *p = dir_next[k];
+}
+
+
+// Reads each block pointed to by the block pointers of the root directory
+// inode into memory the first time the directory is needed, and indexes it.
+void load_dir()
+{
+    int b, n, k;
+    if ( dir_loaded ) return;
+    for ( b = 0; b < NO_DIR_BLKS; b++ ) {
+        n = NUM_INODES - 1 - b * DIR_PER_BLK;
+        if ( n > DIR_PER_BLK ) n = DIR_PER_BLK;
+        read_meta( dir_blk_addr( b ), mem_dir + b * DIR_PER_BLK,
+                   n * sizeof( dir_entry_t ) );
+    }
+    memset( dir_head, 0, sizeof( dir_head ) );
+    for ( k = 0; k < NUM_INODES - 1; k++ )
+        if ( mem_dir[k].inode != 0 ) dir_link( k );
+    dir_loaded = 1;
+}
+
+
+// Helpers to write the in-memory inode table and free bitmap back to disk.
+// Only the slices belonging to groups that were modified since the last call
+// are written, so a change to one file costs one inode table slice and one
+// bitmap block. A slice that fails to be written stays dirty.
+void mark_inode( int ino )
+{
+    inode_dirty |= 1 << INODE_GROUP( ino );
+}
+
+
+void persist_inodes()
+{
+    int g;
+    for ( g = 0; g < NUM_GROUPS; g++ ) {
+        if ( !( inode_dirty & ( 1 << g ) ) ) continue;
+        sb_mark_dirty();
+        if ( write_meta( GRP_INODE_ADDR( g ), table + g * INODES_PER_GRP,
+                         INODES_PER_GRP * sizeof( inode_t ) ) != 
+             INODE_BLKS_PER_GRP ) {
+            fprintf( stderr, "Failed to write inode table %d.\n", g );
+            continue;
+        }
+        inode_dirty &= ~( 1 << g );
+    }
+}
+
+
+// Blocks reserved by any thread but not yet used are written out as free (see
+// resv_bit_map), so that neither a crash nor a thread that never flushes its
+// pool leaks them on disk. The reference tables go out first, since blocks are
+// released in both at once.
+void persist_bitmap()
+{
+    int g, i;
+    uint8_t slice[GRP_BITMAP_BYTES];
+    persist_refs();
+    uint32_t dirty = __atomic_exchange_n( &bitmap_dirty, 0, __ATOMIC_RELAXED );
+    for ( g = 0; g < NUM_GROUPS; g++ ) {
+        if ( !( dirty & ( 1 << g ) ) ) continue;
+        sb_mark_dirty();
+        for ( i = 0; i < GRP_BITMAP_BYTES; i++ )
+            slice[i] = __atomic_load_n( &free_bit_map[g * GRP_BITMAP_BYTES + i],
+                                        __ATOMIC_ACQUIRE ) |
+                       __atomic_load_n( &resv_bit_map[g * GRP_BITMAP_BYTES + i],
+                                        __ATOMIC_ACQUIRE );
+        if ( write_meta( GRP_BITMAP_ADDR( g ), slice, 
+                         GRP_BITMAP_BYTES ) != 1 ) {
+            fprintf( stderr, "Failed to write free bitmap %d.\n", g );
+            __atomic_fetch_or( &bitmap_dirty, 1 << g, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+
+// Writes the super block to the start of every group. Only the copy in group 0
+// is read on mount; the others are backups for recovery tools.
+int write_sb_copies()
+{
+    int g;
+    for ( g = 0; g < NUM_GROUPS; g++ )
+        if ( write_meta( GRP_BASE( g ), &sb, sizeof( sb ) ) != 1 ) return -1;
+    return 0;
+}
+
+
+// Picks the group for a new inode: the one with the most free blocks among the
+// groups that still have a free inode, so that new files spread out over the
+// disk and each has room to grow next to its inode.
+int pick_inode_group()
+{
+    int g, best = -1;
+    for ( g = 0; g < NUM_GROUPS; g++ ) {
+        if ( sb.grp_free_inodes[g] == 0 ) continue;
+        if ( best == -1 || sb.grp_free_blks[g] > sb.grp_free_blks[best] )
+            best = g;
+    }
+    return best;
 }
 
 
@@ -62,36 +784,37 @@ void init_root_dir()
 {
     int i;
     inode_t root;
+    memset( &root, 0, sizeof( root ) );
     root.link_cnt = 1;
     root.mode = 0666;
     root.uid = 0;
     root.gid = 1;
+    root.size = NO_DIR_BLKS * BLOCK_SIZE;
     for ( i = 0; i < NO_DIR_BLKS; i++ ) {
         if ( i == 12 ) break;
-        root.blk_ptr[i] = get_index();
+        root.blk_ptr[i] = alloc_blk( 0 );
     }
     // If the maximum number of files is greater than what can be stored in 12
     // blocks, indirection is used; an index is obtained for the indirect
     // pointer, a buffer of unsigned integers corresponding to block indexes is
-    // initialized and filled with indices using get_index() while there are
+    // initialized and filled with indices using alloc_blk() while there are
     // still blocks required. The indirect block is then written to disk.
     if ( NO_DIR_BLKS > 12 ) {
-        root.indirect = get_index();
+        root.indirect = alloc_blk( 0 );
         unsigned int buf[BLOCK_SIZE/sizeof( unsigned int )];
+        memset( buf, 0, sizeof( buf ) );
         while ( i < NO_DIR_BLKS ) {
-            buf[i] = get_index();
+            buf[i - 12] = alloc_blk( 0 );
             i++;
         }
-        write_blocks( root.indirect, 1, buf );
-    } else {
-        while ( i < 12 ) { 
-            root.blk_ptr[i] = 0; 
-            i++; 
-        }
-        root.indirect = 0;
+        write_indirect( root.indirect, buf );
     }
     memcpy( table, &root, sizeof( inode_t ) );
-    for ( i = 0; i < NUM_INODES - 1; i++ ) mem_dir[i].inode = 0;
+    for ( i = 0; i < NUM_INODES - 1; i++ ) {
+        mem_dir[i].inode = 0;
+        mem_dir[i].filename[0] = '\0';
+    }
+    memset( dir_head, 0, sizeof( dir_head ) );
 }
 
 
@@ -148,17 +871,37 @@ int check_filename( char* fname )
 }
 
 
+// New files start out empty and inline, so creating one allocates no block.
 void init_inode( inode_t *n )
 {
-    int i;
     n -> mode = 0666;
     n -> link_cnt = 1;
     n -> uid = 0;
     n -> gid = 1;
     n -> size = 0;
-    for ( i = 0; i < 12; i++ ) n -> blk_ptr[i] = 0;
-    n -> indirect = 0;
-    n -> blk_ptr[0] = get_index();
+    n -> flags = INODE_INLINE;
+    memset( n -> data, 0, INLINE_MAX );
+}
+
+
+// Returns the index in the in-memory directory of the entry named fname, or -1
+// if there is no such file.
+int find_file( const char *fname )
+{
+    int k;
+    load_dir();
+    for ( k = dir_head[name_hash( fname )] - 1; k >= 0; k = dir_next[k] - 1 )
+        if ( strcmp( mem_dir[k].filename, fname ) == 0 ) return k;
+    return -1;
+}
+
+
+// Records that inode ino changed just now.
+void touch( int ino )
+{
+    struct timespec t;
+    clock_gettime( CLOCK_REALTIME, &t );
+    mtimes[ino] = ( uint64_t )t.tv_sec * 1000000000 + t.tv_nsec;
 }
 
 
@@ -167,222 +910,352 @@ void init_inode( inode_t *n )
 // with the file descriptor table, in-memory directory cache and, inode table,
 // and the super block, inode table, and free block bitmap are wrote to the disk.
 // Else, a pre-existing disk is initialized using init_disk, and the super
-// block, inode table, and free block bitmap are read into "memory." The free
-// bitmap is stored at the end of the disk partition in the last blocks, so the 
-// block or blocks it is stored in is calculated based on the number of blocks
-// in the file system.
-void mksfs( int fresh )
+// block and the inode table slices of every group are read into "memory." The
+// free bitmap slices and the directory are loaded lazily by load_grp_bitmap()
+// and load_dir(), and if the super block says the volume was cleanly unmounted
+// its free space counters are used as is instead of being rebuilt by a scan.
+// Inodes left flagged INODE_ORPHAN by a crash are handed to the reclaimer,
+// which is started last.
+void do_mksfs( int fresh, int ro )
 {
-    int i, addr;
+    int i, g;
+    stop_reclaimer();
+    pthread_mutex_lock( &fs_lock );
+    read_only = ro;
+    mount_gen++;
+    touch( 0 );
+    for ( i = 1; i < NUM_INODES; i++ ) mtimes[i] = mtimes[0];
+    orphan_cnt = 0;
+    clu_ino = 0;
+    snap_loaded = 0;
+    snap_cur = 0;
+    grp_loaded = 0;
+    bitmap_dirty = 0;
+    inode_dirty = 0;
+    dir_dirty = 0;
+    dir_loaded = 0;
+    counters_valid = 0;
+    sb_dirty = 0;
+    ind_addr = 0;
+    ind_dirty = 0;
+    refs_loaded = 0;
+    refs_dirty = 0;
+    ndropped = 0;
+    meta_err = 0;
+    memset( ddx_head, 0, sizeof( ddx_head ) );
+    // Pools still hold blocks of the bitmap of the previous mount.
+    resv_reset();
     if ( fresh ) {
         if ( init_fresh_disk( DISK_NAME, BLOCK_SIZE, NUM_BLOCKS ) == -1 )
             die( "Failed to initialize fresh disk.\n" );
         init_super_block();
-        if ( write_blocks( 0, 1, &sb ) != 1 )
-            die( "Only one block should have been written.\n" );
 
-        // The bits for the super block, inode table and free bitmap are forced
-        // to used state so that they are not accidentally allocated to a file
-        force_set_index( 0 );
-        for ( i = 1; i < NUM_INODE_BLOCKS + 1; i++ ) force_set_index( i );
-        for ( i = 1; i < SIZE/BLOCK_SIZE + 2; i++ )
-            force_set_index( NUM_BLOCKS - i );
+        // The bits for the super block, inode table and free bitmap of every
+        // group are forced to used state so that they are not accidentally
+        // allocated to a file, as are the bits past the end of the disk in the
+        // last bitmap byte.
+        memset( free_bit_map, UINT8_MAX, SIZE );
+        ext_rebuild();
+        for ( g = 0; g < NUM_GROUPS; g++ )
+            for ( i = 0; i < GRP_DATA_START; i++ )
+                force_set_index( GRP_BASE( g ) + i );
+        for ( i = NUM_BLOCKS; i < SIZE * 8; i++ ) force_set_index( i );
+        grp_loaded = ( 1 << NUM_GROUPS ) - 1;
+        bitmap_dirty = grp_loaded;
+        inode_dirty = grp_loaded;
+        memset( refs, 0, sizeof( refs ) );
+        refs_loaded = grp_loaded;
+        refs_dirty = grp_loaded;
+        dir_loaded = 1;
+        init_inode_table();
+        recount();
 
         // Root directory and inode table are initialized before being stored on
         // disk; file descriptor table is initialized
-        init_inode_table();
         init_root_dir();
         init_fdt();
-        if ( write_blocks(1, NUM_INODE_BLOCKS, table ) != NUM_INODE_BLOCKS )
-            die( "Incorrect number of blocks written for inode table.\n" );
-        for ( i = 0; i < NO_DIR_BLKS; i++ ) {
-            if ( i == 12 ) break;
-            write_blocks( table[sb.root_dir_inode].blk_ptr[i], 
-                          1, mem_dir + BLOCK_SIZE * i );
-        }
-        if ( NO_DIR_BLKS > 12 ) {
-            unsigned int buf[BLOCK_SIZE/sizeof( unsigned int )];
-            read_blocks( table[sb.root_dir_inode].indirect, 1, buf );
-            while ( i < NO_DIR_BLKS ) {
-                write_blocks( buf[i], 1, mem_dir + BLOCK_SIZE * i );
-                i++;
-            }
-        }
-        addr = NUM_BLOCKS - (SIZE/BLOCK_SIZE + 1);
-        if ( write_blocks( addr, SIZE/BLOCK_SIZE + 1, free_bit_map ) != 
-             SIZE/BLOCK_SIZE + 1 )
-            die( "Incorrect number of blocks written from free bitmap.\n" );
+        if ( write_sb_copies() == -1 )
+            die( "Failed to write super block to disk.\n" );
+        sb_dirty = 1;
+        persist_inodes();
+        for ( i = 0; i < NO_DIR_BLKS; i++ ) write_dir_blk( i );
+        persist_bitmap();
+        if ( meta_err ) die( "Failed to write file system to disk.\n" );
     } else {
         if ( init_disk( DISK_NAME, BLOCK_SIZE, NUM_BLOCKS ) == -1 )
             die( "Failed to initialize pre-existing disk.\n" );
-        if( read_blocks( 0, 1, &sb ) != 1 )
+        if( read_meta( 0, &sb, sizeof( sb ) ) != 1 )
             die( "Failed to read super block from disk" );
-        if ( read_blocks( 1, sb.inode_table_len, table ) != NUM_INODE_BLOCKS )
-            die( "Incorrect number of blocks read to inode table" );
-        addr = NUM_BLOCKS - (SIZE/sb.block_size + 1 );
-        if ( read_blocks( addr, SIZE/sb.block_size + 1, free_bit_map ) != 
-             SIZE/sb.block_size + 1)
-            die( "Incorrect number of blocks read to free bitmap.\n" );
+        if ( sb.magic_num != MAGIC_NUM || sb.num_groups != NUM_GROUPS )
+            die( "Disk was not formatted with this version of the file system" );
+        for ( g = 0; g < NUM_GROUPS; g++ )
+            if ( read_meta( GRP_INODE_ADDR( g ), table + g * INODES_PER_GRP,
+                            INODES_PER_GRP * sizeof( inode_t ) ) != 
+                 INODE_BLKS_PER_GRP )
+                die( "Incorrect number of blocks read to inode table" );
+        counters_valid = sb.clean;
+        sb_dirty = !sb.clean;
+        for ( i = 0; i < NUM_INODES; i++ )
+            if ( table[i].flags & INODE_ORPHAN ) orphan_cnt++;
 
-        // Read each block pointed to by the block pointers of the root
-        // directory inode into memory. 
-        i = 0;
-        for ( i = 0; i < NO_DIR_BLKS; i++ ) {
-            if ( i == 12 ) break;
-            read_blocks( table[sb.root_dir_inode].blk_ptr[i], 
-                         1, mem_dir + i * BLOCK_SIZE );
-        }
-        if ( NO_DIR_BLKS > 12 ) {
-            unsigned int buf[BLOCK_SIZE/sizeof( unsigned int )];
-            read_blocks( table[sb.root_dir_inode].indirect, 1, buf );
-            while ( i < NO_DIR_BLKS ) {
-                read_blocks( buf[i], 1, mem_dir + BLOCK_SIZE * i );
-                i++;
-            }
+        // What is otherwise loaded on first use is loaded now on a read-only
+        // volume, so that readers going without the lock find it in place.
+        if ( ro ) {
+            load_dir();
+            for ( g = 0; g < NUM_GROUPS; g++ ) load_grp_refs( g );
         }
+
         // Initialize the file descriptor table.
         init_fdt();
     }
+    pthread_mutex_unlock( &fs_lock );
+    if ( !ro ) start_reclaimer();
 }
 
 
-// To get the next filename and remember the current position in the directory, 
-// a global variable, dir_i (declared above), is initialized to 0 and 
-// maintained. On each call of sfs_getnextfilename(), the filename stored at the
-// index dir_i in the in-memory directory cache is copied to the return string
-// and dir_i is incremented and returned. If dir_i is equal to the length of the
-// directory table, it is reset to 0 and 0 is returned, indicating that all 
-// files have been read. Thus, it is assumed that on the first call of
-// sfs_getnextfilename(), dir_i is equal to 0, which is actively maintained
-// before calls to sfs_getnextfilename() are made.
-int sfs_getnextfilename( char *fname ) 
+void mksfs( int fresh )
 {
-    int *index = &dir_i;
-    strcpy( fname, mem_dir[*index].filename );
-    ( *index )++;
-    if ( *index == NUM_INODES - 1 ) *index = 0;
-    return *index; 
+    do_mksfs( fresh, 0 );
 }
 
 
-// sfs_getfilesize is simple to implement; if the file exists in the directory
-// cache, find its file size from its inode. If it doesn't exist, return 0.
-int sfs_getfilesize( const char *fname )
+// Mounts the existing disk read-only (see read_only above). Orphans are left
+// for the next read-write mount to reclaim, and sfs_unmount() writes nothing.
+void mksfs_ro( void )
 {
-    char name[21];
-    dir_i = 0;
-    while ( sfs_getnextfilename( name ) ) {
+    do_mksfs( 0, 1 );
+}
 
-        if ( strcmp( name, fname ) == 0 ) {
-            int inode_i = mem_dir[dir_i].inode;
-            return table[inode_i].size;
-        }
-        dir_i++;
-    }
+
+// Fails a call that would change a volume mounted with mksfs_ro().
+// @return 0 if the volume may be changed, or -1 with errno set to EROFS.
+int check_writable()
+{
+    if ( !read_only ) return 0;
+    fprintf( stderr, "The file system is mounted read-only.\n" );
+    errno = EROFS;
+    return -1;
+}
+
+
+// Turns the result res of a call that changed the volume into a failure with
+// errno set to EIO if any of the metadata it changed failed to reach the disk.
+int meta_result( int res )
+{
+    if ( !meta_err ) return res;
+    meta_err = 0;
+    errno = EIO;
+    return -1;
+}
+
+
+// Reports the number of free data blocks and free inodes. On a cleanly
+// unmounted volume this is answered from the checkpoint in the super block
+// without touching the disk.
+int sfs_statfs( uint32_t *free_blks, uint32_t *free_inodes )
+{
+    pthread_mutex_lock( &fs_lock );
+    if ( !counters_valid ) load_bitmap();
+    if ( free_blks ) *free_blks = sb.free_blk_cnt;
+    if ( free_inodes ) *free_inodes = sb.free_inode_cnt;
+    pthread_mutex_unlock( &fs_lock );
     return 0;
 }
 
-// First, the in-memory directory index is scanned through using 
-// sfs_getnextfilename(), and the filenames returned are compared with fname to 
-// determine if the file already exists. If it does, the loop is broken and
-// dir_i stores the index in the in-memory directory mapping where the inode
-// index of the requested file is stored, so this index is saved into inode_i.
-// The file descriptor table is then looped over to search for an empty or
-// inactive entry by checking whether the inode field of the fdt is equal to 0,
-// and the inode index of the file is then stored there. The read/write pointer
-// of the file is then initialized in append mode, so it is set to the size
-// field of the file in its inode. 
-//
-// If the file doesn't exist, an inode for the file must be created and stored
-// in the inode table in-memory and then written to disk. A directory entry for
-// the file must also be created and then written to disk. Error checking must
-// also be performed to ensure that the length of the filename and extension are
-// valid. A fresh data block must be allocated, and the modified free bitmap
-// must also be written to disk
 
-// @return the fileID of the file that was opened, or -1 on failure.
-int sfs_fopen( char *fname ) 
+// Returns the blocks the calling thread has reserved but not used to the free
+// bitmap. Threads that write files should call this before they exit.
+void release_reservations()
 {
     int i;
-    char name[21];
-    dir_i = 0;
-    if (check_filename( fname ) ) {
-            perror( "Filename is incorrectly formatted.\n" );
-            return -1;
-        }
-    while( sfs_getnextfilename( name ) ) if (strcmp( fname, name ) == 0 ) break;
-    if ( dir_i ) {
-        for ( i = 0; i < NUM_INODES - 1; i++ ) {
-            if ( mem_dir[dir_i].inode == fdt[i].inode ) return -1;
-        }
-        int inode_i = mem_dir[dir_i].inode;
-        for ( i = 1; i < NUM_INODES; i++ ) {
-            if ( fdt[i].inode == 0 ) {
-                fdt[i].inode = inode_i;
-                fdt[i].rw_ptr = table[inode_i].size;
-                return i;
-            }
-            if ( i == NUM_INODES - 1 ) {
-                perror( "Inode table full" );
-                return -1;
-            }
-        }
-    } else {
-        // Loop through inodes in table to find one that is no longer in use
-        // (link_cnt == 0), and if one is found loop through the file
-        // descriptor table to find an entry that is not in use (inode = 0).
+    for ( i = 0; i < resv_pool.n; i++ )
+        __atomic_fetch_or( &bitmap_dirty, 1 << BLK_GROUP( resv_pool.blks[i] ),
+                           __ATOMIC_RELAXED );
+    flush_reservation();
+}
+
+
+void sfs_flush_reservations( void )
+{
+    pthread_mutex_lock( &fs_lock );
+    release_reservations();
+    pthread_mutex_unlock( &fs_lock );
+}
+
+
+// Stops the reclaimer once it has freed the blocks of every removed file, then
+// writes out the free bitmap and a super block with the clean flag set so that
+// the next mount can skip rebuilding the free space summary, then closes the
+// disk. All file descriptors are invalidated. Metadata that earlier calls
+// failed to write is written first; if any of it fails again, the disk is left
+// open and -1 is returned with errno set to EIO, so the call can be retried.
+int sfs_unmount( void )
+{
+    int i, res = 0;
+    stop_reclaimer();
+    pthread_mutex_lock( &fs_lock );
+    release_reservations();
+    if ( !read_only ) {
+        flush_indirect();
+        for ( i = 0; i < NO_DIR_BLKS; i++ ) 
+            if ( dir_dirty & ( 1 << i ) ) write_dir_blk( i );
+        persist_inodes();
+        persist_bitmap();
+        if ( !counters_valid ) load_bitmap();
+        sb.clean = 1;
+    }
+    if ( !read_only && 
+         ( meta_result( 0 ) == -1 || write_sb_copies() == -1 ) ) {
+        res = -1;
+    } else {
+        init_fdt();
+        close_disk();
+        clu_ino = 0;
+        grp_loaded = 0;
+        dir_loaded = 0;
+        sb_dirty = 0;
+    }
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+// To get the next filename and remember the current position in the directory, 
+// a global variable, dir_i (declared above), is initialized to 0 and 
+// maintained. On each call of sfs_getnextfilename(), the next filename in use
+// at or after the index dir_i in the in-memory directory cache is copied to the
+// return string, dir_i is moved past it and 1 is returned. Once the end of the
+// directory table is reached, dir_i is reset to 0 and 0 is returned,
+// indicating that all files have been read.
+int sfs_getnextfilename( char *fname ) 
+{
+    int *index = &dir_i;
+    int found = 0;
+    pthread_mutex_lock( &fs_lock );
+    load_dir();
+    while ( *index < NUM_INODES - 1 && mem_dir[*index].inode == 0 ) ( *index )++;
+    if ( *index == NUM_INODES - 1 ) {
+        *index = 0;
+    } else {
+        strcpy( fname, mem_dir[*index].filename );
+        ( *index )++;
+        found = 1;
+    }
+    pthread_mutex_unlock( &fs_lock );
+    return found; 
+}
+
+
+// sfs_getfilesize is simple to implement; if the file exists in the directory
+// cache, find its file size from its inode. If it doesn't exist, return -1, so
+// that the FUSE wrapper can tell a missing file from an empty one.
+int sfs_getfilesize( const char *fname )
+{
+    int k, size = -1;
+    if ( !read_only ) pthread_mutex_lock( &fs_lock );
+    if ( ( k = find_file( fname ) ) != -1 ) size = table[mem_dir[k].inode].size;
+    if ( !read_only ) pthread_mutex_unlock( &fs_lock );
+    return size;
+}
+
+
+// Returns the time fname last changed (see mtimes), in nanoseconds since the
+// epoch, or 0 if there is no such file. The FUSE wrapper reports it as the
+// modification time, which is what tells the kernel to drop the pages it has
+// cached for a file that changed.
+uint64_t sfs_getmtime( const char *fname )
+{
+    uint64_t t = 0;
+    int k;
+    if ( !read_only ) pthread_mutex_lock( &fs_lock );
+    if ( ( k = find_file( fname ) ) != -1 ) t = mtimes[mem_dir[k].inode];
+    if ( !read_only ) pthread_mutex_unlock( &fs_lock );
+    return t;
+}
+
+// First, the in-memory directory is searched with find_file() to determine if
+// the file already exists. If it does, the slot found stores the inode index of
+// the requested file. If the file is already open its existing fileID is
+// returned, otherwise the file descriptor table is then looped over to search
+// for an empty or inactive entry by checking whether the inode field of the fdt
+// is equal to 0, and the inode index of the file is then stored there. The
+// read/write pointer of the file is then initialized in append mode, so it is
+// set to the size field of the file in its inode. 
+//
+// If the file doesn't exist, an inode for the file must be created and stored
+// in the inode table in-memory and then written to disk. A directory entry for
+// the file must also be created and then written to disk. Error checking must
+// also be performed to ensure that the length of the filename and extension are
+// valid. No data block is allocated since the new file is empty and stored
+// inline in its inode, so neither the free bitmap nor the free block counters
+// change. The free inode counter in the super block lets
+// a full inode table fail without scanning it.
+
+// @return the fileID of the file that was opened, or -1 on failure.
+int do_fopen( char *fname )
+{
+    int i, k;
+    if (check_filename( fname ) ) {
+            perror( "Filename is incorrectly formatted.\n" );
+            return -1;
+        }
+    if ( ( k = find_file( fname ) ) != -1 ) {
+        int inode_i = mem_dir[k].inode;
+        for ( i = 0; i < NUM_INODES - 1; i++ )
+            if ( fdt[i].inode == inode_i ) return i;
+        for ( i = 0; i < NUM_INODES - 1; i++ ) {
+            if ( fdt[i].inode == 0 ) {
+                fdt[i].inode = inode_i;
+                fdt[i].rw_ptr = table[inode_i].size;
+                return i;
+            }
+        }
+        perror( "File descriptor table full" );
+        return -1;
+    } else {
+        // Loop through inodes in table to find one that is no longer in use
+        // (link_cnt == 0), and if one is found loop through the file
+        // descriptor table to find an entry that is not in use (inode = 0).
         // Initialize a new inode, copy it to the inode table at the valid entry
         // save the index of the inode entry into the fdt table and set the 
         // read/write pointer to 0. Return the index of the file in the file
         // descriptor table.
-        // TODO: Make a directory entry for the file.
-        for ( i = 1; i < NUM_INODES; i++ ) {
-            if ( table[i].link_cnt == 0 ) {
-                int j, k, addr;
+        if ( check_writable() == -1 ) return -1;
+        if ( !counters_valid ) load_bitmap();
+        if ( sb.free_inode_cnt == 0 ) reclaim_orphans();
+        if ( sb.free_inode_cnt == 0 ) {
+            perror( "Inode table full" );
+            return -1;
+        }
+        int g = pick_inode_group();
+        for ( i = g * INODES_PER_GRP; i < ( g + 1 ) * INODES_PER_GRP; i++ ) {
+            if ( i != sb.root_dir_inode && table[i].link_cnt == 0 ) {
+                int j;
                 for ( j = 0; j < NUM_INODES - 1; j++ ) {
                     if ( fdt[j].inode == 0 ) {
                         for ( k = 0; k < NUM_INODES - 1; k++ ) {
                             if ( mem_dir[k].inode == 0 ) {
                                 inode_t node;
                                 init_inode( &node );
+                                node.flags |= cur_codec << 8;
                                 memcpy( &table[i], &node, sizeof( inode_t ) );
+                                mark_inode( i );
+                                sb.free_inode_cnt--;
+                                sb.grp_free_inodes[g]--;
                                 fdt[j].inode = i;
                                 fdt[j].rw_ptr = 0;
                                 mem_dir[k].inode = i;
                                 strcpy( mem_dir[k].filename, fname );
+                                dir_link( k );
+                                touch( i );
 
-                                // DEBUGGING
-                                printf( "%s\n", mem_dir[k].filename );
-
-                                // Write the inode table and modified bitmap to 
-                                // disk
-                                write_blocks(1, NUM_INODE_BLOCKS, table );
-                                addr = NUM_BLOCKS - (SIZE/BLOCK_SIZE + 1);
-                                write_blocks( addr, SIZE/BLOCK_SIZE + 1, 
-                                              free_bit_map );
-
-                                // Write the block of the directory that
-                                // was modified if an empty directory slot was
-                                // found. This requires determining whether or 
-                                // not the indirection pointer is required.
-                                if ( k/BLOCK_SIZE > 11 ) {
-                                    unsigned int buf[BLOCK_SIZE/sizeof( unsigned int )];
-                                    read_blocks( table[sb.root_dir_inode].indirect,
-                                                 1, buf );
-                                    addr = buf[k % BLOCK_SIZE];
-                                    write_blocks( addr, 1, 
-                                                  mem_dir + 
-                                                  ( k/BLOCK_SIZE ) * 
-                                                  BLOCK_SIZE );
-                                }
-                                else {
-                                    addr = 
-                                    table[sb.root_dir_inode].blk_ptr[k/BLOCK_SIZE];
-                                    write_blocks( addr, 1, 
-                                                  mem_dir + 
-                                                  ( k/BLOCK_SIZE ) * 
-                                                  BLOCK_SIZE );
-                                }
+                                // Creating a file is metadata-only: write the
+                                // inode table slice, followed by the block of
+                                // the directory that holds the new entry. The
+                                // bitmap is untouched until the first write
+                                // needs a block.
+                                persist_inodes();
+                                write_dir_blk( k/DIR_PER_BLK );
                                 return j;
                             }
                         }
@@ -402,13 +1275,519 @@ int sfs_fopen( char *fname )
 // @return 0 upon success or -1 on failure.
 int sfs_fclose( int fileID )
 {
-    if ( fdt[fileID].inode == 0 ) {
+    int res = 0;
+    pthread_mutex_lock( &fs_lock );
+    if ( fileID < 0 || fileID >= NUM_INODES - 1 || fdt[fileID].inode == 0 ) {
         perror( "Cannot close an fileID that is already closed.\n" );
-        return -1;
+        res = -1;
     } else {
         fdt[fileID].inode = 0;
         fdt[fileID].rw_ptr = 0;
     }
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+// Returns the disk address of logical block lblk of inode ino. The first 12
+// logical blocks are mapped by the direct pointers and the rest by the indirect
+// block. If the block is not mapped and alloc is set, a block is allocated
+// right after the one holding the previous logical block if possible, or else
+// in the inode's group (falling back to the next groups), and mapped, and
+// *fresh is set so the caller knows the block holds stale contents; otherwise 0 is
+// returned for an unmapped block, which is never a valid data block because
+// block 0 holds the super block. 0 is also returned when the disk is full, and
+// for every block of an inline file, which has none.
+uint32_t bmap( int ino, int lblk, int alloc, int *fresh )
+{
+    inode_t *n = &table[ino];
+    int grp = INODE_GROUP( ino );
+    if ( fresh ) *fresh = 0;
+    if ( n -> flags & INODE_INLINE ) return 0;
+    uint32_t goal = 0;
+    if ( lblk > 0 && lblk <= 12 && alloc ) goal = n -> blk_ptr[lblk - 1];
+    if ( lblk < 12 ) {
+        if ( n -> blk_ptr[lblk] == 0 && alloc ) {
+            n -> blk_ptr[lblk] = alloc_blk_near( grp, goal );
+            if ( n -> blk_ptr[lblk] == 0 ) return 0;
+            mark_inode( ino );
+            if ( fresh ) *fresh = 1;
+        }
+        return n -> blk_ptr[lblk];
+    }
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    lblk -= 12;
+
+    // Initialize the indirect pointer if this hasn't already been done and
+    // write the block with 0's.
+    if ( n -> indirect == 0 ) {
+        if ( !alloc ) return 0;
+        if ( ( n -> indirect = alloc_blk_near( grp, goal ) ) == 0 ) return 0;
+        mark_inode( ino );
+        memset( blk_indices, 0, BLOCK_SIZE );
+    } else {
+        read_indirect( n -> indirect, blk_indices );
+    }
+    if ( blk_indices[lblk] == 0 && alloc ) {
+        if ( lblk > 0 ) goal = blk_indices[lblk - 1];
+        if ( lblk == 0 ) goal = n -> indirect;
+        if ( ( blk_indices[lblk] = alloc_blk_near( grp, goal ) ) == 0 ) 
+            return 0;
+        write_indirect( n -> indirect, blk_indices );
+        if ( fresh ) *fresh = 1;
+    }
+    return blk_indices[lblk];
+}
+
+
+// Points logical block lblk of inode ino at blk, allocating the indirect block
+// if it is needed and not there yet.
+// @return 0 on success or -1 if the disk is full.
+int map_blk( int ino, int lblk, uint32_t blk )
+{
+    inode_t *n = &table[ino];
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    if ( lblk < 12 ) {
+        n -> blk_ptr[lblk] = blk;
+        mark_inode( ino );
+        return 0;
+    }
+    if ( n -> indirect == 0 ) {
+        if ( ( n -> indirect = alloc_blk_near( INODE_GROUP( ino ), blk ) ) == 0 ) 
+            return -1;
+        mark_inode( ino );
+        memset( blk_indices, 0, BLOCK_SIZE );
+    } else {
+        read_indirect( n -> indirect, blk_indices );
+    }
+    blk_indices[lblk - 12] = blk;
+    write_indirect( n -> indirect, blk_indices );
+    return 0;
+}
+
+
+// A block that a write stops using is only let go of once the inode no longer
+// pointing to it has been written, so that a crash in between cannot leave
+// the file pointing to a freed block.
+void drop_blk( uint32_t blk )
+{
+    dropped[ndropped++] = blk;
+}
+
+
+void release_dropped()
+{
+    free_blks( dropped, ndropped );
+    ndropped = 0;
+}
+
+
+// Makes blk, which holds logical block lblk of inode ino, safe to overwrite.
+// A block shared with other files is swapped for a new one in the file (copy
+// on write; the caller writes the whole of it) and dropped. A block in the
+// dedup index leaves it, as its contents are about to change.
+// @return the block to write to, or 0 if the disk is full.
+uint32_t own_blk( int ino, int lblk, uint32_t blk )
+{
+    blk_ref_t *r = blk_ref( blk );
+    uint32_t copy;
+    if ( r -> refs == 0 ) {
+        if ( r -> flags & REF_HASHED ) ddx_remove( blk );
+        return blk;
+    }
+    if ( ( copy = alloc_blk_near( INODE_GROUP( ino ), blk ) ) == 0 ) return 0;
+    if ( map_blk( ino, lblk, copy ) == -1 ) {
+        free_blks( &copy, 1 );
+        return 0;
+    }
+    drop_blk( blk );
+    STAT_ADD( cow, 1 );
+    return copy;
+}
+
+
+// A fast hash of the contents of a block, taken 8 bytes at a time and folded
+// to 32 bits. Equal hashes are always confirmed by comparing the blocks.
+uint32_t blk_hash( const uint8_t *data )
+{
+    uint64_t h = 0x9e3779b97f4a7c15ull, w;
+    int i;
+    for ( i = 0; i < BLOCK_SIZE; i += sizeof( w ) ) {
+        memcpy( &w, data + i, sizeof( w ) );
+        h = ( h ^ w ) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return ( uint32_t )( h ^ ( h >> 29 ) );
+}
+
+
+// Stores data as logical block lblk of inode ino in dedup mode. If a block
+// with the same contents is in the dedup index, the file is pointed at it and
+// it gains a reference instead of anything being written. Otherwise the data
+// is written to the block already there if no other file shares it, or to a
+// new one, and that block is added to the index. A block the file no longer
+// uses is dropped.
+// @return 0 on success, or -1 with errno set to ENOSPC if the disk is full or
+// to EIO if the block fails to be written.
+int put_blk( int ino, int lblk, const uint8_t *data )
+{
+    uint8_t cand[BLOCK_SIZE];
+    uint32_t h = blk_hash( data ), old = bmap( ino, lblk, 0, NULL ), b, goal;
+    int g;
+    for ( g = 0; g < NUM_GROUPS; g++ ) load_grp_refs( g );
+    for ( b = ddx_head[h % DEDUP_BUCKETS]; b != 0; b = ddx_next[b] ) {
+        if ( refs[b].hash != h ) continue;
+        read_data( b, 1, cand );
+        if ( memcmp( cand, data, BLOCK_SIZE ) != 0 ) continue;
+        if ( b == old ) return 0;
+        if ( map_blk( ino, lblk, b ) == -1 ) goto full;
+        refs[b].refs++;
+        refs_dirty |= 1 << BLK_GROUP( b );
+        if ( old != 0 ) drop_blk( old );
+        STAT_ADD( dedup_hits, 1 );
+        return 0;
+    }
+    if ( old != 0 && refs[old].refs == 0 ) {
+        if ( refs[old].flags & REF_HASHED ) ddx_remove( old );
+        b = old;
+    } else {
+        goal = lblk > 0 ? bmap( ino, lblk - 1, 0, NULL ) : 0;
+        if ( ( b = alloc_blk_near( INODE_GROUP( ino ), goal ) ) == 0 ) 
+            goto full;
+        if ( map_blk( ino, lblk, b ) == -1 ) {
+            free_blks( &b, 1 );
+            goto full;
+        }
+        if ( old != 0 ) {
+            drop_blk( old );
+            STAT_ADD( cow, 1 );
+        }
+    }
+    if ( write_data( b, 1, data ) == -1 ) {
+        fprintf( stderr, "Failed to write block %u.\n", b );
+        errno = EIO;
+        return -1;
+    }
+    refs[b].hash = h;
+    refs[b].flags |= REF_HASHED;
+    refs_dirty |= 1 << BLK_GROUP( b );
+    ddx_insert( b );
+    return 0;
+full:
+    errno = ENOSPC;
+    return -1;
+}
+
+
+// Returns the number of slots of cluster c, which is CLUSTER_BLKS except for a
+// last cluster cut short by the maximum file size.
+int cluster_slots( int c )
+{
+    int left = MAX_LBLKS - c * CLUSTER_BLKS;
+    return left < CLUSTER_BLKS ? left : CLUSTER_BLKS;
+}
+
+
+// Reads the pointers of the slots of cluster c of inode ino into ptr, which
+// may be split between the direct pointers and the indirect block. Missing
+// slots read as 0.
+void get_cluster_ptrs( int ino, int c, uint32_t *ptr )
+{
+    inode_t *n = &table[ino];
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    int i, l = c * CLUSTER_BLKS;
+    if ( l + CLUSTER_BLKS > 12 && n -> indirect != 0 ) 
+        read_indirect( n -> indirect, blk_indices );
+    for ( i = 0; i < CLUSTER_BLKS; i++, l++ ) {
+        if ( l < 12 ) ptr[i] = n -> blk_ptr[l];
+        else if ( l < MAX_LBLKS && n -> indirect != 0 ) 
+            ptr[i] = blk_indices[l - 12];
+        else ptr[i] = 0;
+    }
+}
+
+
+// Reads or writes the blocks of the slots of a cluster that are set in mask,
+// slot i going to or from buf + i * BLOCK_SIZE, with one request per run of
+// consecutive blocks.
+// @return 0 on success or -1 if any of the blocks fails to transfer.
+int xfer_slots( const uint32_t *ptr, int mask, uint8_t *buf, int write )
+{
+    int i, j, res = 0;
+    for ( i = 0; i < CLUSTER_BLKS; i = j ) {
+        j = i + 1;
+        if ( !( mask & ( 1 << i ) ) ) continue;
+        while ( j < CLUSTER_BLKS && ( mask & ( 1 << j ) ) && 
+                ptr[j] == ptr[j - 1] + 1 ) j++;
+        if ( write ) {
+            if ( write_data( ptr[i], j - i, buf + i * BLOCK_SIZE ) == -1 ) 
+                res = -1;
+        } else if ( read_data( ptr[i], j - i, buf + i * BLOCK_SIZE ) == -1 ) {
+            res = -1;
+        }
+    }
+    return res;
+}
+
+
+// Stores the cached cluster if it was changed. It is packed with the file's
+// codec and stored compressed if that saves at least one block over storing
+// its data blocks as is. The blocks the cluster had are reused first, missing
+// ones are allocated next to them and any left over are dropped, to be freed
+// by the caller's release_dropped() once the inode has been written.
+// @return 0 on success, or -1 with errno set to ENOSPC if the disk is full, in
+// which case the cluster on disk is left as it was, or to EIO if it fails to be
+// written, in which case the blocks it reused hold what was written of it.
+// Either way the cached copy is dropped.
+int flush_cluster()
+{
+    uint32_t ptr[CLUSTER_BLKS], old[CLUSTER_BLKS], fresh[CLUSTER_BLKS + 1];
+    uint32_t shared[CLUSTER_BLKS], goal = 0, ind = 0;
+    uint8_t packed[CLUSTER_BYTES];
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    int i, mask, nold = 0, nshared = 0, reuse = 0, nfresh = 0, raw = 0;
+    int plen = 0;
+    if ( !clu_dirty ) return 0;
+    inode_t *n = &table[clu_ino];
+    int grp = INODE_GROUP( clu_ino );
+    int l = clu_idx * CLUSTER_BLKS;
+    int nslots = cluster_slots( clu_idx );
+    const sfs_codec_t *codec = codecs[INODE_CODEC( n )];
+    get_cluster_ptrs( clu_ino, clu_idx, ptr );
+    // Blocks shared with a clone are never written over, only let go of.
+    for ( i = 0; i < CLUSTER_BLKS; i++ ) {
+        if ( ptr[i] != 0 && !( ptr[i] & CLUSTER_TAG ) ) {
+            if ( blk_ref( ptr[i] ) -> refs == 0 ) old[nold++] = ptr[i];
+            else shared[nshared++] = ptr[i];
+        }
+        if ( clu_map & ( 1 << i ) ) raw++;
+    }
+    if ( codec != NULL && raw > 1 )
+        plen = codec -> compress( clu_buf, clu_len, packed, 
+                                  ( raw - 1 ) * BLOCK_SIZE );
+    mask = plen > 0 ? ( 1 << ( plen + BLOCK_SIZE - 1 )/BLOCK_SIZE ) - 1 
+                    : clu_map;
+
+    // Get every block needed before touching the disk so that running out of
+    // space changes nothing.
+    if ( l + nslots > 12 && n -> indirect == 0 ) {
+        if ( ( ind = alloc_blk( grp ) ) == 0 ) goto full;
+        fresh[nfresh++] = ind;
+    }
+    for ( i = 0; i < CLUSTER_BLKS; i++ ) {
+        ptr[i] = 0;
+        if ( !( mask & ( 1 << i ) ) ) continue;
+        if ( reuse < nold ) {
+            ptr[i] = old[reuse++];
+        } else {
+            if ( ( ptr[i] = alloc_blk_near( grp, goal ) ) == 0 ) goto full;
+            fresh[nfresh++] = ptr[i];
+        }
+        goal = ptr[i];
+    }
+    if ( plen > 0 ) memset( packed + plen, 0, CLUSTER_BYTES - plen );
+    if ( xfer_slots( ptr, mask, plen > 0 ? packed : clu_buf, 1 ) == -1 ) {
+        fprintf( stderr, "Failed to write cluster %d.\n", clu_idx );
+        errno = EIO;
+        goto failed;
+    }
+    if ( plen > 0 ) 
+        ptr[nslots - 1] = CLUSTER_TAG | INODE_CODEC( n ) << 16 | plen;
+    for ( i = reuse; i < nold; i++ ) drop_blk( old[i] );
+    for ( i = 0; i < nshared; i++ ) drop_blk( shared[i] );
+    STAT_ADD( cow, nshared );
+    if ( ind != 0 ) {
+        n -> indirect = ind;
+        memset( blk_indices, 0, BLOCK_SIZE );
+    } else if ( l + nslots > 12 ) {
+        read_indirect( n -> indirect, blk_indices );
+    }
+    for ( i = 0; i < nslots; i++ ) {
+        if ( l + i < 12 ) n -> blk_ptr[l + i] = ptr[i];
+        else blk_indices[l + i - 12] = ptr[i];
+    }
+    if ( l + nslots > 12 ) write_indirect( n -> indirect, blk_indices );
+    mark_inode( clu_ino );
+    clu_dirty = 0;
+    return 0;
+full:
+    errno = ENOSPC;
+failed:
+    free_blks( fresh, nfresh );
+    clu_ino = 0;
+    clu_dirty = 0;
+    return -1;
+}
+
+
+// Reads cluster c of inode ino into buf, unpacking it if it is stored
+// compressed, and sets *map to the slots that hold data. The bytes past the
+// end of the file are zero.
+// @return the number of bytes of file data in the cluster, or -1 if it cannot
+// be unpacked.
+int unpack_cluster( int ino, int c, uint8_t *buf, int *map )
+{
+    uint32_t ptr[CLUSTER_BLKS], tag;
+    uint8_t packed[CLUSTER_BYTES];
+    int i, len = table[ino].size - c * CLUSTER_BYTES;
+    const sfs_codec_t *codec;
+    if ( len < 0 ) len = 0;
+    if ( len > CLUSTER_BYTES ) len = CLUSTER_BYTES;
+    memset( buf, 0, CLUSTER_BYTES );
+    *map = 0;
+    get_cluster_ptrs( ino, c, ptr );
+    tag = ptr[cluster_slots( c ) - 1];
+    if ( tag & CLUSTER_TAG ) {
+        codec = CLUSTER_CODEC( tag ) < SFS_MAX_CODECS ? 
+                codecs[CLUSTER_CODEC( tag )] : NULL;
+        if ( xfer_slots( ptr, ( 1 << ( CLUSTER_LEN( tag ) + BLOCK_SIZE - 1 )/
+                              BLOCK_SIZE ) - 1, packed, 0 ) == -1 ||
+             codec == NULL || codec -> decompress( packed, CLUSTER_LEN( tag ),
+                                                   buf, CLUSTER_BYTES ) 
+             == -1 ) {
+            perror( "Cannot unpack a compressed cluster.\n" );
+            memset( buf, 0, CLUSTER_BYTES );
+            return -1;
+        }
+        *map = ( 1 << ( len + BLOCK_SIZE - 1 )/BLOCK_SIZE ) - 1;
+    } else {
+        for ( i = 0; i < CLUSTER_BLKS; i++ )
+            if ( ptr[i] != 0 ) *map |= 1 << i;
+        if ( xfer_slots( ptr, *map, buf, 0 ) == -1 ) {
+            *map = 0;
+            return -1;
+        }
+    }
+    return len;
+}
+
+
+// Makes cluster c of inode ino the cached one.
+// @return 0 on success, or -1 if the cluster cannot be unpacked.
+int load_cluster( int ino, int c )
+{
+    int len;
+    if ( clu_ino == ino && clu_idx == c ) return 0;
+    if ( flush_cluster() == -1 ) return -1;
+    clu_ino = 0;
+    if ( ( len = unpack_cluster( ino, c, clu_buf, &clu_map ) ) == -1 ) 
+        return -1;
+    clu_ino = ino;
+    clu_idx = c;
+    clu_len = len;
+    return 0;
+}
+
+
+// load_cluster() for the readers of a read-only volume, each of which has a
+// cache of its own and so needs no lock.
+int ro_load_cluster( int ino, int c )
+{
+    int map;
+    if ( ro_clu_gen == mount_gen && ro_clu_ino == ino && ro_clu_idx == c ) 
+        return 0;
+    ro_clu_ino = 0;
+    if ( unpack_cluster( ino, c, ro_clu_buf, &map ) == -1 ) return -1;
+
+    // The snapshot slot holds a different inode from one snapshot file to the
+    // next, so its clusters are not kept.
+    if ( ino == SNAP_INO ) return 0;
+    ro_clu_gen = mount_gen;
+    ro_clu_ino = ino;
+    ro_clu_idx = c;
+    return 0;
+}
+
+
+// Reads and writes the data of a compressed file a cluster at a time through
+// the cached cluster. Every cluster written is stored before moving on to the
+// next.
+// @return the number of bytes transferred, short if a cluster could not be
+// read or the disk filled up.
+int read_clusters( int ino, unsigned int pos, char *buf, int length )
+{
+    int done = 0, off, chunk, c;
+    while ( done < length ) {
+        off = ( pos + done ) % CLUSTER_BYTES;
+        chunk = CLUSTER_BYTES - off;
+        if ( chunk > length - done ) chunk = length - done;
+        c = ( pos + done )/CLUSTER_BYTES;
+        if ( read_only ) {
+            if ( ro_load_cluster( ino, c ) == -1 ) break;
+            memcpy( buf + done, ro_clu_buf + off, chunk );
+        } else {
+            if ( load_cluster( ino, c ) == -1 ) break;
+            memcpy( buf + done, clu_buf + off, chunk );
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+
+int write_clusters( int ino, unsigned int pos, const char *buf, int length )
+{
+    int done = 0, off, chunk, b;
+    while ( done < length ) {
+        off = ( pos + done ) % CLUSTER_BYTES;
+        chunk = CLUSTER_BYTES - off;
+        if ( chunk > length - done ) chunk = length - done;
+        if ( load_cluster( ino, ( pos + done )/CLUSTER_BYTES ) == -1 ) break;
+        memcpy( clu_buf + off, buf + done, chunk );
+        for ( b = off/BLOCK_SIZE; b * BLOCK_SIZE < off + chunk; b++ ) 
+            clu_map |= 1 << b;
+        if ( clu_len < off + chunk ) clu_len = off + chunk;
+        clu_dirty = 1;
+        if ( flush_cluster() == -1 ) break;
+        done += chunk;
+    }
+    return done;
+}
+
+
+// Moves the contents of an inline file into its first data block so that it
+// can grow past INLINE_MAX. A compressed file becomes its first cluster
+// instead. The inode is left inline if that fails.
+// @return 0 on success, or -1 with errno set to ENOSPC if no block could be
+// allocated or to EIO if it fails to be written.
+int promote_inline( int ino )
+{
+    inode_t *n = &table[ino];
+    uint8_t blk_buf[BLOCK_SIZE];
+    uint32_t blk;
+    memset( blk_buf, 0, BLOCK_SIZE );
+    memcpy( blk_buf, n -> data, n -> size );
+    memset( n -> data, 0, INLINE_MAX );
+    n -> flags &= ~INODE_INLINE;
+    mark_inode( ino );
+    if ( n -> size == 0 ) return 0;
+    if ( INODE_CODEC( n ) ) {
+        if ( load_cluster( ino, 0 ) == 0 ) {
+            memcpy( clu_buf, blk_buf, n -> size );
+            clu_len = n -> size;
+            clu_map = 1;
+            clu_dirty = 1;
+            if ( flush_cluster() == 0 ) return 0;
+        }
+        memcpy( n -> data, blk_buf, n -> size );
+        n -> flags |= INODE_INLINE;
+        return -1;
+    }
+    if ( ( blk = bmap( ino, 0, 1, NULL ) ) == 0 ) {
+        memcpy( n -> data, blk_buf, n -> size );
+        n -> flags |= INODE_INLINE;
+        errno = ENOSPC;
+        return -1;
+    }
+    if ( write_data( blk, 1, blk_buf ) == -1 ) {
+        fprintf( stderr, "Failed to write block %u.\n", blk );
+        n -> blk_ptr[0] = 0;
+        free_blks( &blk, 1 );
+        memcpy( n -> data, blk_buf, n -> size );
+        n -> flags |= INODE_INLINE;
+        errno = EIO;
+        return -1;
+    }
     return 0;
 }
 
@@ -424,251 +1803,199 @@ int sfs_fclose( int fileID )
 // Error checking must be done before writing: whether the fileID is valid must
 // be checked; shouldn't write to a closed file. It must also be checked that
 // the number of bytes written will not exceed the maximum file size.
-// It is assumed that the block pointers in the inode are stored in the order of 
-// the file, so the read/write pointer determines which block will be written to
-// first. That block is loaded into a buffer, and the first portion of bytes to
-// be written are used to fill the block buffer from the read/write pointer to 
-// the end of the block, and then this block is written back onto the disk.
-// Next, subsequent blocks are first checked to see if they are allocated, and
-// allocated if not, and bytes are written from buf until the last 1024 bytes
-// are reached. Once this happens, the final block is read into the block
-// buffer, the remaining bytes are copied, and this buffer is written back onto
-// the disk; this is to ensure that the end of a file isn't lost if the writing
-// is being done to the middle of a file. 
-// Finally, The modified inode table
-// EDIT: The first block to be written only needs to be read if the read/write
-// pointer points to somewhere in the middle of the block. If it is at the
-// beginning of a block, i.e. (rw_ptr % BLOCK_SIZE == 0), then this step can be
-// skipped. 
-int sfs_fwrite( int fileID, char *buf, int length )
+// The write is done one block at a time, with bmap() translating the position
+// of the read/write pointer into a disk block and allocating it if needed.
+// Blocks that are completely overwritten are written straight from buf. A
+// block that is only partially overwritten is first loaded into a buffer so
+// that the rest of its contents are not lost, unless it was just allocated, in
+// which case the buffer is zeroed instead. If the disk fills up or a block
+// fails to be written, the write stops early and the number of bytes actually
+// written is returned; the failed block counts for neither the size nor the
+// read/write pointer.
+// A write that leaves an inline file no larger than INLINE_MAX only changes the
+// inode; a larger one first moves the file to a data block with
+// promote_inline(). A compressed file is written a cluster at a time by
+// write_clusters() instead.
+// Finally, the modified inode table slice and bitmap slices are written to
+// disk.
+int do_fwrite( int fileID, char *buf, int length )
 {
-    int i, blk_no, buf_i;
+    int buf_i, fresh, off, chunk, lblk;
+    uint32_t blk;
     unsigned int rw_ptr;
     uint8_t blk_buf[BLOCK_SIZE];
-    if ( fdt[fileID].inode == 0 ) {
+    const uint8_t *data;
+    if ( check_writable() == -1 ) return -1;
+    if ( fileID < 0 || fileID >= NUM_INODES - 1 || fdt[fileID].inode == 0 ) {
         perror( "Cannot write to a close file.\n" );
         return -1;
     } 
     file_descriptor_t *fd = &fdt[fileID];
     inode_t *n = &table[fd -> inode];
     rw_ptr = fd -> rw_ptr;
-    if ( rw_ptr + length > MAX_FILE_SIZE ) {
+    if ( length < 0 || rw_ptr + length > MAX_FILE_SIZE ) {
         perror( "Buffer to write will exceed maximum file size.\n" );
         return -1;
     }
-    blk_no = rw_ptr/BLOCK_SIZE;
     buf_i = 0;
-
-    // Check if the first block needs to be partially written based on the 
-    // modulo of the rw_ptr and if so update that blocks
-    if ( rw_ptr % BLOCK_SIZE != 0 ) {
-        if ( n -> blk_ptr[blk_no] == 0 ) n -> blk_ptr[blk_no] = get_index();
-        read_blocks( n -> blk_ptr[blk_no], 1, blk_buf );
-        for ( i = rw_ptr % BLOCK_SIZE; i < BLOCK_SIZE; i++ ) {
-            blk_buf[i] = buf[buf_i];
-            buf_i++;
-        }
-        write_blocks( n -> blk_ptr[blk_no], 1, blk_buf );
+    if ( ( n -> flags & INODE_INLINE ) && rw_ptr + length <= INLINE_MAX ) {
+        memcpy( n -> data + rw_ptr, buf, length );
+        mark_inode( fd -> inode );
+        buf_i = length;
+        rw_ptr += length;
+    } else if ( ( n -> flags & INODE_INLINE ) && 
+                promote_inline( fd -> inode ) == -1 ) {
+        fprintf( stderr, "Cannot move the file out of its inode.\n" );
+        return -1;
+    }
+    if ( INODE_CODEC( n ) && buf_i < length ) {
+        buf_i = write_clusters( fd -> inode, rw_ptr, buf, length );
+        if ( buf_i < length ) fprintf( stderr, "Cannot store cluster.\n" );
         rw_ptr += buf_i;
-        blk_no++;
-    }
-    // While the rest of the buf hasn't been written, write the blocks pointed
-    // to by the twelve direct pointers.
-    while ( buf_i < length - BLOCK_SIZE ) {
-        if (blk_no >= 12 ) break;
-        if ( n -> blk_ptr[blk_no] == 0 ) n -> blk_ptr[blk_no] = get_index();
-        write_blocks( n-> blk_ptr[blk_no], 1, buf + buf_i );
-        buf_i += BLOCK_SIZE;
-        rw_ptr += BLOCK_SIZE;
-        blk_no++;
-    }
-    // Once the loop has terminated, either the last bytes to be written have 
-    // been reached and the final block has to be partially updated, or the 
-    // blocks pointed to by the indirect pointer need to start being written to.
-    if ( blk_no < 11 ) {
-        if ( n -> blk_ptr[blk_no] == 0 ) n -> blk_ptr[blk_no] = get_index();
-        read_blocks( n -> blk_ptr[blk_no], 1, blk_buf );
-        int max = length - buf_i;
-        for ( i = 0; i < max; i++ ) {
-            blk_buf[i] = buf[buf_i];
-            buf_i++;
-            rw_ptr++;
-        }
-        write_blocks( n -> blk_ptr[blk_no], 1, blk_buf );
-    } else {
-        // Initialize the indirect pointer if this hasn't already been done and
-        // write the block with 0's.
-        if ( n -> indirect == 0 ) {
-            n -> indirect = get_index();
-            reset_buf( glb_buf );
-            write_blocks( n -> indirect, 1, glb_buf );
-        }
-        // Read the block indices into the new buffer
-        unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
-        blk_no = 0;
-        read_blocks( n -> indirect, 1, blk_indices );
-        // Check if the first block needs to be partially written based on the 
-        // modulo of the rw_ptr and if so update that block, as before
-        if ( rw_ptr % BLOCK_SIZE != 0 ) {
-            if ( blk_indices[blk_no] == 0 ) blk_indices[blk_no] = get_index();
-            read_blocks( blk_indices[blk_no], 1, blk_buf );
-            for ( i = rw_ptr % BLOCK_SIZE; i < BLOCK_SIZE; i++ ) {
-                blk_buf[i] = buf[buf_i];
-                buf_i++;
+    }
+    while ( !INODE_CODEC( n ) && buf_i < length ) {
+        off = rw_ptr % BLOCK_SIZE;
+        chunk = BLOCK_SIZE - off;
+        if ( chunk > length - buf_i ) chunk = length - buf_i;
+        lblk = rw_ptr/BLOCK_SIZE;
+        blk = bmap( fd -> inode, lblk, !dedup, &fresh );
+        if ( blk == 0 && !dedup ) {
+            perror( "Disk is full.\n" );
+            break;
+        }
+        data = ( const uint8_t * )buf + buf_i;
+        if ( chunk != BLOCK_SIZE ) {
+            // A block past the end of the file, such as one reserved by
+            // sfs_fcreate(), holds no file data, so there is nothing to keep.
+            if ( blk == 0 || fresh || rw_ptr - off >= n -> size ) {
+                memset( blk_buf, 0, BLOCK_SIZE );
+            } else if ( read_data( blk, 1, blk_buf ) == -1 ) {
+                errno = EIO;
+                break;
+            } else {
+                STAT_ADD( rmw, 1 );
             }
-        write_blocks( blk_indices[blk_no], 1, blk_buf );
-        rw_ptr += buf_i;
-        blk_no++;
-        }
-        // Continue writing blocks from the buffer
-        while ( buf_i < length - BLOCK_SIZE ) {
-            if ( blk_indices[blk_no] == 0 ) blk_indices[blk_no] = get_index();
-            write_blocks( blk_indices[blk_no], 1, buf + buf_i );
-            buf_i += BLOCK_SIZE;
-            rw_ptr += BLOCK_SIZE;
-            blk_no++;
-        }
-        if ( blk_indices[blk_no] == 0 ) blk_indices[blk_no] = get_index();
-        read_blocks( blk_indices[blk_no], 1, blk_buf );
-        int max = length = buf_i;
-        for ( i = 0; i < max; i++ ) {
-            blk_buf[i] = buf[buf_i];
-            buf_i++;
-            rw_ptr++;
-        }
-        write_blocks( blk_indices[blk_no], 1, blk_buf );
-        write_blocks( n -> indirect, 1, blk_indices );
-    }
-    if ( n -> size < rw_ptr ) n -> size = rw_ptr;
-    fdt -> rw_ptr = rw_ptr;
-
-    // Write the inode table and modified bitmap to disk
-    write_blocks(1, NUM_INODE_BLOCKS, table );
-    int addr = NUM_BLOCKS - (SIZE/BLOCK_SIZE + 1);
-    write_blocks( addr, SIZE/BLOCK_SIZE + 1, free_bit_map );
+            memcpy( blk_buf + off, buf + buf_i, chunk );
+            data = blk_buf;
+        }
+        if ( dedup ) {
+            if ( put_blk( fd -> inode, lblk, data ) == -1 ) {
+                perror( "Cannot store block.\n" );
+                break;
+            }
+        } else {
+            if ( !fresh && ( blk = own_blk( fd -> inode, lblk, blk ) ) == 0 ) {
+                perror( "Disk is full.\n" );
+                break;
+            }
+            if ( write_data( blk, 1, data ) == -1 ) {
+                fprintf( stderr, "Failed to write block %u.\n", blk );
+                errno = EIO;
+                break;
+            }
+        }
+        buf_i += chunk;
+        rw_ptr += chunk;
+    }
+    if ( n -> size < rw_ptr ) {
+        n -> size = rw_ptr;
+        mark_inode( fd -> inode );
+    }
+    fd -> rw_ptr = rw_ptr;
+    if ( buf_i > 0 ) touch( fd -> inode );
+
+    // Write the inode table and modified bitmap to disk. References a write
+    // took go out before the inode that uses them, and blocks it dropped are
+    // only released after it.
+    persist_refs();
+    persist_inodes();
+    release_dropped();
+    persist_bitmap();
+    if ( buf_i == 0 && length > 0 ) return -1;
     return buf_i;
 }
 
 
 // sfs_fread() follows the same kind of structure as sfs_fwrite() but is simpler
 // because no writing needs to be done on the disk, only reading the specified
-// blocks. 
-// Error checking must be done to prevent reading from invalid or closed file 
-// handles. Error checking must also be done to ensure that reading is not being
-// done past the end of the file. 
-// First, it is determined whether the read/write pointer points to the middle
-// of a block using modulo, and if so, the block is read to a temporary buffer
-// and a segment of that block is copied to buf. Then, successive blocks are
-// read and copied to buf until either the last block has been reached or all of
-// the blocks pointed to by the direct pointers have been read, in which case
-// the block indices pointed to by the indirect pointer are loaded and the same
-// procedure is applied to reading these blocks until the last block is reached.
-// Once the last block is reached, it is read and the last segment of bytes are
-// copied to buf. the read/write pointer is then updated in the file descriptor
-// table and the number of bytes copied is returned.
+// blocks. The reading itself is done by read_at(), which sfs_snapshot_read()
+// shares. A read that would go past the end of the file is shortened to stop
+// at the end of the file, so reading at the end of the file returns 0.
+// Blocks that are read in full are read straight into buf, while the partial
+// blocks at either end of the range are loaded into a temporary buffer and the
+// needed segment is copied. Holes in a sparse file are unmapped blocks and
+// are filled with zeros without touching the disk. An inline file is copied
+// straight from its inode, and a compressed one goes through read_clusters().
+// A block that fails its checksum ends the read early.
 // @return the number of bytes read to buf on success, -1 on failure.
-int sfs_fread( int fileID, char *buf, int length )
+int read_at( int ino, unsigned int pos, char *buf, int length )
 {
-    int i, blk_no, buf_i;
-    unsigned int rw_ptr;
+    int buf_i, off, chunk;
+    uint32_t blk;
     uint8_t blk_buf[BLOCK_SIZE];
-    // Check whether the file handle is closed and whether an attempt to read
-    // past the end of the file is made
-    if ( fdt[fileID].inode == 0 ) {
-        perror( "Cannot read from a closed or invalid file handle.\n" );
-        return -1;
+    inode_t *n = &table[ino];
+    if ( length < 0 ) return -1;
+    if ( pos >= n -> size ) return 0;
+    if ( pos + length > n -> size ) length = n -> size - pos;
+    if ( n -> flags & INODE_INLINE ) {
+        memcpy( buf, n -> data + pos, length );
+        return length;
     }
-    file_descriptor_t *fd = &fdt[fileID];
-    inode_t *n = &table[fd -> inode];
-    rw_ptr = fd -> rw_ptr;
-    if ( rw_ptr + length > n -> size ) {
-        perror( "Cannot read past the end of the file.\n" );
-        return -1;
+    if ( INODE_CODEC( n ) ) {
+        buf_i = read_clusters( ino, pos, buf, length );
+        return buf_i == 0 && length > 0 ? -1 : buf_i;
     }
-    // Initialize the index into buf and the block number and, if the read/write
-    // pointer points to the middle of that block, load it and copy the segment
     buf_i = 0;
-    blk_no = rw_ptr/BLOCK_SIZE;
-    if ( (i = rw_ptr % BLOCK_SIZE ) != 0 ) {
-        read_blocks( n -> blk_ptr[blk_no], 1, blk_buf );
-        i = rw_ptr % BLOCK_SIZE;
-        while ( i < BLOCK_SIZE && buf_i < length ) {
-            buf[buf_i] = blk_buf[i];
-            i++;
-            buf_i++;
-            rw_ptr++;
-        }
-        blk_no++;
-    }
-    // Loop over the rest of the blocks pointed to by the direct pointers until
-    // the last block has been reached or the indirect blocks are required.
-    while ( buf_i < length - BLOCK_SIZE ) {
-        if ( blk_no >= 12 ) break;
-        read_blocks( n -> blk_ptr[blk_no], 1, buf + buf_i );
-        buf_i += BLOCK_SIZE;
-        rw_ptr += BLOCK_SIZE;
-        blk_no++;
-    }
-    // If the indirect blocks are required, load the indirect block into
-    // blk_indices and copy blocks as above.
-    if ( blk_no > 11 ) {
-        unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
-        read_blocks( n -> indirect, 1, blk_indices );
-        blk_no = 0;
-        if ( ( i = rw_ptr % BLOCK_SIZE ) != 0 ) {
-            read_blocks( blk_indices[blk_no], 1, blk_buf );
-            i = rw_ptr % BLOCK_SIZE;
-            while ( i < BLOCK_SIZE && buf_i < length ) {
-                buf[buf_i] = blk_buf[i];
-                i++;
-                buf_i++;
-                rw_ptr++;
-            }
-            blk_no++;
-        }
-        while ( buf_i < length - BLOCK_SIZE ) {
-            read_blocks( blk_indices[blk_no], 1, buf + buf_i );
-            buf_i += BLOCK_SIZE;
-            rw_ptr+= BLOCK_SIZE;
-            blk_no++;
-        }
-        read_blocks( blk_indices[blk_no], 1, blk_buf );
-        int max = length - buf_i;
-        for ( i = 0; i < max; i++ ) {
-            buf[buf_i] = blk_buf[i];
-            buf_i++;
-            rw_ptr++;
-        }
-    // Load the final block and copy the final bytes from it.
-    } else {
-        read_blocks( n -> blk_ptr[blk_no], 1, blk_buf );
-        int max = length - buf_i;
-        for ( i = 0; i < max; i++ ) {
-            buf[buf_i] = blk_buf[i];
-            buf_i++;
-            rw_ptr++;
+    while ( buf_i < length ) {
+        off = pos % BLOCK_SIZE;
+        chunk = BLOCK_SIZE - off;
+        if ( chunk > length - buf_i ) chunk = length - buf_i;
+        if ( ( blk = bmap( ino, pos/BLOCK_SIZE, 0, NULL ) ) == 0 ) {
+            memset( buf + buf_i, 0, chunk );
+        } else if ( chunk == BLOCK_SIZE ) {
+            if ( read_data( blk, 1, buf + buf_i ) == -1 ) break;
+        } else {
+            if ( read_data( blk, 1, blk_buf ) == -1 ) break;
+            memcpy( buf + buf_i, blk_buf + off, chunk );
         }
+        buf_i += chunk;
+        pos += chunk;
     }
-    // Update the read/write pointer and return the number of bytes read.
-    fd -> rw_ptr = rw_ptr;
-    return buf_i;
+    return buf_i == 0 && length > 0 ? -1 : buf_i;
+}
+
+
+// Error checking must be done to prevent reading from invalid or closed file 
+// handles. The read/write pointer is then moved past the bytes read.
+int do_fread( int fileID, char *buf, int length )
+{
+    int res;
+    if ( fileID < 0 || fileID >= NUM_INODES - 1 || fdt[fileID].inode == 0 ) {
+        perror( "Cannot read from a closed or invalid file handle.\n" );
+        return -1;
+    }
+    file_descriptor_t *fd = &fdt[fileID];
+    res = read_at( fd -> inode, fd -> rw_ptr, buf, length );
+    if ( res > 0 ) fd -> rw_ptr += res;
+    return res;
 }
 
 
 // To implement sfs_fseek(), the read/write pointer in the file descriptor table
 // simply needs to be updated. However, error checking must be done to ensure
 // that the file handle provided is valid and that the location being seeked is
-// valid.
-int sfs_fseek( int fileID, int loc )
+// valid. Seeking past the end of the file is allowed; a write there leaves a
+// hole between the old end of the file and the write, which takes no blocks
+// and reads back as zeros.
+int do_fseek( int fileID, int loc )
 {
-    if ( fdt[fileID].inode == 0 ) {
+    if ( fileID < 0 || fileID >= NUM_INODES - 1 || fdt[fileID].inode == 0 ) {
         perror( "Cannot seek on a closed or invalid file handle.\n" );
         return -1;
     }
     file_descriptor_t *fd = &fdt[fileID];
-    inode_t *n = &table[fd -> inode];
-    if ( loc < 0 || loc > n -> size ) {
-        perror( "The location requested is either negative or past the end of file.\n" );
+    if ( loc < 0 || loc > MAX_FILE_SIZE ) {
+        perror( "The location requested is either negative or past the maximum file size.\n" );
         return -1;
     }
     fd -> rw_ptr = loc;
@@ -676,65 +2003,1085 @@ int sfs_fseek( int fileID, int loc )
 }
 
 
-// To remove a file, all of the allocated blocks in the free bitmap must be
-// deallocated. If the indirect pointer is also allocated, then the indirect
-// block must be loaded and loop through, deallocating any blocks there. The
-// indirect pointer itself is then deallocated. The fields in the file's inode
-// are then all set to 0, and the inode in the in-memory directory map is set to
-// 0, and the first character of the filename is set to null, '\0', so that the
-// filename can no longer be looked up. The free bitmap, inode table, and
-// modified directory entry are then written to disk. 
-// Error checking is done to see if the file exists in the first place.
-int sfs_remove( char *fname )
+// Returns the first offset at or after loc that is in a hole of inode ino, if
+// hole is set, or that holds data otherwise, going by which logical blocks are
+// mapped. A compressed file is looked at a cluster at a time, since a packed
+// cluster leaves some of its slots unmapped. The end of the file counts as the
+// start of a hole. Returns -1 when there is no data at or after loc.
+int find_data_or_hole( int ino, int loc, int hole )
 {
-    int i;
-    char name[21];
-    dir_i = 0;
-    while( sfs_getnextfilename( name ) ) {
-        if (strcmp( name, fname ) == 0 ) break;
+    inode_t *n = &table[ino];
+    int l, i, mapped, unit = INODE_CODEC( n ) ? CLUSTER_BLKS : 1;
+    if ( loc >= n -> size ) return hole ? loc : -1;
+    if ( n -> flags & INODE_INLINE ) return hole ? n -> size : loc;
+    for ( l = loc/BLOCK_SIZE/unit * unit; l * BLOCK_SIZE < n -> size; 
+          l += unit ) {
+        for ( mapped = 0, i = 0; i < unit && l + i < MAX_LBLKS; i++ ) 
+            mapped |= bmap( ino, l + i, 0, NULL ) != 0;
+        if ( mapped != hole ) 
+            return l * BLOCK_SIZE > loc ? l * BLOCK_SIZE : loc;
     }
-    if ( dir_i == 0 ) {
-        perror( "The filename specified does not exist.\n" );
+    return hole ? n -> size : -1;
+}
+
+
+// Moves the read/write pointer like lseek(). whence is one of SFS_SEEK_SET,
+// SFS_SEEK_CUR or SFS_SEEK_END, which take offset relative to the start, the
+// read/write pointer or the end of the file, or SFS_SEEK_DATA or SFS_SEEK_HOLE,
+// which move to the start of the first data or hole at or after offset so that
+// a sparse file can be copied without reading its holes.
+// @return the new position, or -1 on failure or if SFS_SEEK_DATA finds no
+// more data.
+int do_flseek( int fileID, int offset, int whence )
+{
+    int loc;
+    if ( fileID < 0 || fileID >= NUM_INODES - 1 || fdt[fileID].inode == 0 ) {
+        perror( "Cannot seek on a closed or invalid file handle.\n" );
         return -1;
     }
-    int inode_i = mem_dir[dir_i].inode;
-    inode_t *n = &table[inode_i];
-    for ( i = 0; i < 12; i++ )
+    file_descriptor_t *fd = &fdt[fileID];
+    inode_t *n = &table[fd -> inode];
+    switch ( whence ) {
+        case SFS_SEEK_SET: loc = offset; break;
+        case SFS_SEEK_CUR: loc = fd -> rw_ptr + offset; break;
+        case SFS_SEEK_END: loc = n -> size + offset; break;
+        case SFS_SEEK_DATA:
+        case SFS_SEEK_HOLE:
+            if ( offset < 0 ) return -1;
+            loc = find_data_or_hole( fd -> inode, offset, 
+                                     whence == SFS_SEEK_HOLE );
+            if ( loc == -1 ) return -1;
+            break;
+        default: return -1;
+    }
+    if ( do_fseek( fileID, loc ) == -1 ) return -1;
+    return loc;
+}
+
+
+// Unmaps every block of inode ino from logical block first on and appends the
+// blocks to list, without freeing them. The tags of packed clusters are
+// cleared along with the blocks. The indirect block goes too if none of its
+// entries are left, and is otherwise rewritten once with the entries cleared.
+// @return the number of blocks added to list.
+int collect_blocks( int ino, int first, uint32_t *list )
+{
+    int i, keep, cnt = 0, changed = 0;
+    inode_t *n = &table[ino];
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    for ( i = first; i < 12; i++ )
         if ( n -> blk_ptr[i] != 0 ) {
-            rm_index( n -> blk_ptr[i] );
+            if ( !( n -> blk_ptr[i] & CLUSTER_TAG ) ) 
+                list[cnt++] = n -> blk_ptr[i];
             n -> blk_ptr[i] = 0;
         }
     if ( n -> indirect != 0 ) {
-        unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
-        read_blocks( n -> indirect, 1, blk_indices );
-        for ( i = 0; i < BLOCK_SIZE/sizeof( unsigned int ); i++ )
-            if ( blk_indices[i] != 0 ) rm_index( blk_indices[i] ); 
-        rm_index( n -> indirect );
-        n -> indirect = 0;
-    }
-    n -> mode = 0;
-    n -> link_cnt = 0;
-    n -> uid = 0;
-    n -> gid = 0;
-    n -> size = 0;
-    mem_dir[dir_i].inode = 0;
-    mem_dir[dir_i].filename[0] = '\0';
-    write_blocks(1, NUM_INODE_BLOCKS, table );
-    int addr = NUM_BLOCKS - (SIZE/BLOCK_SIZE + 1);
-    write_blocks( addr, SIZE/BLOCK_SIZE + 1, free_bit_map );
-    if ( dir_i/BLOCK_SIZE > 11 ) {
-        unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
-        read_blocks( table[sb.root_dir_inode].indirect, 1, blk_indices );
-        addr = blk_indices[dir_i % BLOCK_SIZE];
-        write_blocks( addr, 1, mem_dir + ( dir_i/BLOCK_SIZE ) * BLOCK_SIZE );
-    } else {
-        addr = table[sb.root_dir_inode].blk_ptr[dir_i/BLOCK_SIZE];
-        write_blocks( addr, 1, mem_dir + ( dir_i/BLOCK_SIZE ) * BLOCK_SIZE );
+        keep = first > 12 ? first - 12 : 0;
+        read_indirect( n -> indirect, blk_indices );
+        for ( i = keep; i < BLOCK_SIZE/sizeof( unsigned int ); i++ )
+            if ( blk_indices[i] != 0 ) {
+                if ( !( blk_indices[i] & CLUSTER_TAG ) ) 
+                    list[cnt++] = blk_indices[i];
+                blk_indices[i] = 0;
+                changed = 1;
+            }
+        if ( keep == 0 ) {
+            list[cnt++] = n -> indirect;
+            n -> indirect = 0;
+        } else if ( changed ) {
+            write_indirect( n -> indirect, blk_indices );
+        }
     }
-    return 0;
+    mark_inode( ino );
+    return cnt;
 }
 
 
+// Frees every block of inode ino from logical block first on.
+void trunc_blocks( int ino, int first )
+{
+    uint32_t list[MAX_FILE_SIZE/BLOCK_SIZE + 1];
+    free_blks( list, collect_blocks( ino, first, list ) );
+}
+
+
+// Sets the size of an open file. Growing a file only moves its end, leaving a
+// hole that reads back as zeros. Shrinking it frees the blocks past the new
+// end, including those reserved by sfs_fcreate(), and zeros the rest of the
+// new last block so that growing the file again cannot expose the old
+// contents. An inline file that would no longer fit is moved to a block
+// first. A compressed file is cut at a cluster boundary instead, and its new
+// last cluster is zeroed past the end and stored again. Blocks are only freed
+// once the new last block or cluster is stored, so a truncate that runs out of
+// space leaves the file as it was.
+// The inode is written once; read/write pointers are left as they are.
+// @return 0 on success or -1 on failure, with errno set to EROFS, EBADF,
+// EINVAL, EFBIG, ENOSPC or EIO.
+int do_ftruncate( int fileID, int size )
+{
+    uint32_t blk;
+    uint8_t blk_buf[BLOCK_SIZE];
+    if ( check_writable() == -1 ) return -1;
+    if ( fileID < 0 || fileID >= NUM_INODES - 1 || fdt[fileID].inode == 0 ) {
+        perror( "Cannot truncate a closed or invalid file handle.\n" );
+        errno = EBADF;
+        return -1;
+    }
+    int ino = fdt[fileID].inode;
+    inode_t *n = &table[ino];
+    if ( size < 0 || size > MAX_FILE_SIZE ) {
+        perror( "The size requested is either negative or past the maximum file size.\n" );
+        errno = size < 0 ? EINVAL : EFBIG;
+        return -1;
+    }
+    if ( n -> flags & INODE_INLINE ) {
+        if ( size <= INLINE_MAX ) {
+            if ( size < n -> size ) 
+                memset( n -> data + size, 0, n -> size - size );
+        } else if ( promote_inline( ino ) == -1 ) {
+            fprintf( stderr, "Cannot move the file out of its inode.\n" );
+            return -1;
+        }
+    } else if ( INODE_CODEC( n ) ) {
+        if ( size < n -> size && size % CLUSTER_BYTES != 0 ) {
+            if ( load_cluster( ino, size/CLUSTER_BYTES ) == -1 ) {
+                errno = EIO;
+                return -1;
+            }
+            clu_len = size % CLUSTER_BYTES;
+            memset( clu_buf + clu_len, 0, CLUSTER_BYTES - clu_len );
+            clu_map &= ( 1 << ( clu_len + BLOCK_SIZE - 1 )/BLOCK_SIZE ) - 1;
+            clu_dirty = 1;
+            if ( flush_cluster() == -1 ) {
+                fprintf( stderr, "Cannot store the last cluster.\n" );
+                return -1;
+            }
+        }
+        if ( clu_ino == ino && clu_idx * CLUSTER_BYTES >= size ) clu_ino = 0;
+        trunc_blocks( ino, ( size + CLUSTER_BYTES - 1 )/CLUSTER_BYTES * 
+                           CLUSTER_BLKS );
+    } else {
+        // The new last block is zeroed before anything is freed, as it may
+        // need a copy that the disk has no room for. A last block that fails
+        // its checksum is left as it is rather than stored again with a
+        // checksum that would match the bad contents.
+        if ( size < n -> size && size % BLOCK_SIZE != 0 &&
+             ( blk = bmap( ino, size/BLOCK_SIZE, 0, NULL ) ) != 0 &&
+             read_data( blk, 1, blk_buf ) != -1 ) {
+            memset( blk_buf + size % BLOCK_SIZE, 0, 
+                    BLOCK_SIZE - size % BLOCK_SIZE );
+            if ( ( blk = own_blk( ino, size/BLOCK_SIZE, blk ) ) == 0 ) {
+                perror( "Disk is full.\n" );
+                errno = ENOSPC;
+                return -1;
+            }
+            if ( write_data( blk, 1, blk_buf ) == -1 ) {
+                fprintf( stderr, "Failed to write block %u.\n", blk );
+                errno = EIO;
+                return -1;
+            }
+            STAT_ADD( rmw, 1 );
+        }
+        trunc_blocks( ino, ( size + BLOCK_SIZE - 1 )/BLOCK_SIZE );
+    }
+    n -> size = size;
+    mark_inode( ino );
+    touch( ino );
+    persist_inodes();
+    release_dropped();
+    persist_bitmap();
+    return 0;
+}
+
+
+// To remove a file, the inode in the in-memory directory map is set to 0 and
+// the first character of the filename is set to null, '\0', so that the
+// filename can no longer be looked up, and any file descriptors on it are
+// closed. Freeing the blocks of a large file takes a while, so instead of
+// doing it here the inode is flagged INODE_ORPHAN and handed to the
+// reclaimer. The directory block is written before the inode so that a crash
+// in between leaks the file rather than leaving a name that points to an
+// orphan; orphans still on disk at mount are reclaimed then.
+// Error checking is done to see if the file exists in the first place.
+int do_remove( char *fname )
+{
+    int i, k;
+    if ( check_writable() == -1 ) return -1;
+    if ( ( k = find_file( fname ) ) == -1 ) {
+        perror( "The filename specified does not exist.\n" );
+        return -1;
+    }
+    int inode_i = mem_dir[k].inode;
+    for ( i = 0; i < NUM_INODES - 1; i++ )
+        if ( fdt[i].inode == inode_i ) fdt[i].inode = 0;
+    if ( clu_ino == inode_i ) clu_ino = 0;
+    dir_unlink( k );
+    mem_dir[k].inode = 0;
+    mem_dir[k].filename[0] = '\0';
+    write_dir_blk( k/DIR_PER_BLK );
+    table[inode_i].flags |= INODE_ORPHAN;
+    mark_inode( inode_i );
+    persist_inodes();
+    orphan_cnt++;
+    pthread_cond_signal( &reclaim_cond );
+    return 0;
+}
+
+
+// Frees the blocks and inodes of all orphans at once. The cleared inodes are
+// written before the freed blocks are returned to the bitmap, so a block is
+// never free on disk while an orphan there still points to it. Called with
+// fs_lock held, from the reclaimer as well as from writers. The reclaimer has
+// no reservation pool of its own, so the bitmap it writes must not depend on
+// the calling thread's pool; persist_bitmap() takes the reserved blocks of
+// every thread from resv_bit_map.
+void reclaim_orphans()
+{
+    int ino, cnt = 0;
+    uint32_t *list;
+    if ( orphan_cnt == 0 ) return;
+    list = malloc( NUM_BLOCKS * sizeof( uint32_t ) );
+    for ( ino = 1; ino < NUM_INODES; ino++ ) {
+        inode_t *n = &table[ino];
+        if ( !( n -> flags & INODE_ORPHAN ) ) continue;
+        if ( !( n -> flags & INODE_INLINE ) )
+            cnt += collect_blocks( ino, 0, list + cnt );
+        memset( n, 0, sizeof( inode_t ) );
+        mark_inode( ino );
+        sb.free_inode_cnt++;
+        sb.grp_free_inodes[INODE_GROUP( ino )]++;
+    }
+    orphan_cnt = 0;
+    persist_inodes();
+    free_blks( list, cnt );
+    persist_bitmap();
+    free( list );
+}
+
+
+// The reclaimer thread. Once woken by a removal it waits RECLAIM_DELAY_MS for
+// more removals to arrive so that they share one round of metadata writes.
+// When asked to stop it first reclaims whatever is left.
+void *reclaimer( void *arg )
+{
+    struct timespec delay = { 0, RECLAIM_DELAY_MS * 1000000 };
+    pthread_mutex_lock( &fs_lock );
+    for ( ;; ) {
+        while ( orphan_cnt == 0 && !reclaim_stop )
+            pthread_cond_wait( &reclaim_cond, &fs_lock );
+        if ( orphan_cnt == 0 ) break;
+        if ( !reclaim_stop ) {
+            pthread_mutex_unlock( &fs_lock );
+            nanosleep( &delay, NULL );
+            pthread_mutex_lock( &fs_lock );
+        }
+        reclaim_orphans();
+        // What failed to be written stays dirty for the next call, which is
+        // not the one to fail for it.
+        meta_err = 0;
+    }
+    pthread_mutex_unlock( &fs_lock );
+    return NULL;
+}
+
+
+void start_reclaimer()
+{
+    reclaim_stop = 0;
+    if ( pthread_create( &reclaim_thread, NULL, reclaimer, NULL ) != 0 )
+        die( "Failed to start the reclaimer thread.\n" );
+    reclaim_running = 1;
+}
+
+
+// Stops the reclaimer after it has freed every pending orphan. Must be called
+// without fs_lock held.
+void stop_reclaimer()
+{
+    if ( !reclaim_running ) return;
+    pthread_mutex_lock( &fs_lock );
+    reclaim_stop = 1;
+    pthread_cond_signal( &reclaim_cond );
+    pthread_mutex_unlock( &fs_lock );
+    pthread_join( reclaim_thread, NULL );
+    reclaim_running = 0;
+}
+
+
+// Lists the disk blocks of inode ino in the order a contiguous layout would
+// place them: the direct blocks, then the indirect block, then the blocks it
+// points to. Unmapped slots and the tags of packed clusters are skipped, and
+// blocks reserved past the end of the file are included. The order is written to blks and the
+// logical block each entry holds to lblks, with -1 marking the indirect block.
+// @return the number of blocks listed.
+int layout_order( int ino, uint32_t *blks, int *lblks )
+{
+    int l, cnt = 0;
+    uint32_t blk;
+    inode_t *n = &table[ino];
+    int nlblks = n -> indirect ? MAX_FILE_SIZE/BLOCK_SIZE : 12;
+    if ( n -> flags & INODE_INLINE ) return 0;
+    for ( l = 0; l < nlblks; l++ ) {
+        if ( l == 12 && n -> indirect != 0 ) {
+            blks[cnt] = n -> indirect;
+            lblks[cnt++] = -1;
+        }
+        if ( ( blk = bmap( ino, l, 0, NULL ) ) == 0 || ( blk & CLUSTER_TAG ) ) 
+            continue;
+        blks[cnt] = blk;
+        lblks[cnt++] = l;
+    }
+    return cnt;
+}
+
+
+// Counts the contiguous runs of blocks making up a file, in the order a
+// sequential read visits them. A file with no blocks has 0 runs.
+// @return the number of runs, or -1 if the file does not exist.
+int count_runs( int ino )
+{
+    int i, cnt, runs = 0;
+    uint32_t blks[MAX_FILE_SIZE/BLOCK_SIZE + 1];
+    int lblks[MAX_FILE_SIZE/BLOCK_SIZE + 1];
+    cnt = layout_order( ino, blks, lblks );
+    for ( i = 0; i < cnt; i++ )
+        if ( i == 0 || blks[i] != blks[i - 1] + 1 ) runs++;
+    return runs;
+}
+
+
+int sfs_fragments( char *fname )
+{
+    int k, runs = -1;
+    pthread_mutex_lock( &fs_lock );
+    if ( ( k = find_file( fname ) ) != -1 ) runs = count_runs( mem_dir[k].inode );
+    pthread_mutex_unlock( &fs_lock );
+    return runs;
+}
 
 
-
+// Moves the blocks of a file into one contiguous run while the file system is
+// mounted. A run large enough for every data block plus the indirect block is
+// allocated, preferably in the inode's group, and the blocks are copied to it
+// with a single sequential write in layout order. The switch to the new
+// blocks is made crash safe by ordering the metadata writes: the bitmap with
+// the new run allocated goes to disk first, then the inode table slice with the
+// new pointers in one write, and only then are the old blocks freed. A crash
+// at any point leaves either the old or the new copy reachable, at worst
+// leaking the other. Open file descriptors are unaffected since they only
+// refer to the inode.
+// @return the number of blocks moved, 0 if the file was already contiguous, or
+// -1 on failure.
+int do_defrag( char *fname )
+{
+    int k, i, ino, cnt;
+    uint32_t run;
+    uint32_t blks[MAX_FILE_SIZE/BLOCK_SIZE + 1];
+    int lblks[MAX_FILE_SIZE/BLOCK_SIZE + 1];
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    if ( check_writable() == -1 ) return -1;
+    if ( ( k = find_file( fname ) ) == -1 ) {
+        perror( "The filename specified does not exist.\n" );
+        return -1;
+    }
+    ino = mem_dir[k].inode;
+    if ( count_runs( ino ) <= 1 ) return 0;
+    cnt = layout_order( ino, blks, lblks );
+
+    // Give back any reserved blocks first so they can be part of the run.
+    release_reservations();
+    if ( ( run = alloc_run( INODE_GROUP( ino ), cnt ) ) == 0 ) {
+        perror( "No free run is large enough to defragment the file.\n" );
+        return -1;
+    }
+    uint8_t *data = malloc( cnt * BLOCK_SIZE );
+    inode_t node = table[ino];
+
+    // Start from the current entries so that the tags of packed clusters,
+    // which are not in the layout, are kept.
+    if ( node.indirect != 0 ) read_indirect( node.indirect, blk_indices );
+    else memset( blk_indices, 0, BLOCK_SIZE );
+    for ( i = 0; i < cnt; i++ ) {
+        if ( lblks[i] == -1 ) {
+            node.indirect = run + i;
+            continue;
+        }
+        if ( read_data( blks[i], 1, data + i * BLOCK_SIZE ) == -1 ) 
+            goto failed;
+        if ( lblks[i] < 12 ) node.blk_ptr[lblks[i]] = run + i;
+        else blk_indices[lblks[i] - 12] = run + i;
+    }
+    for ( i = 0; i < cnt; i++ )
+        if ( lblks[i] == -1 )
+            memcpy( data + i * BLOCK_SIZE, blk_indices, BLOCK_SIZE );
+    if ( write_data( run, cnt, data ) == -1 ) {
+        fprintf( stderr, "Failed to write the new run.\n" );
+        errno = EIO;
+        goto failed;
+    }
+    free( data );
+
+    persist_bitmap();
+    table[ino] = node;
+    mark_inode( ino );
+    persist_inodes();
+    free_blks( blks, cnt );
+    persist_bitmap();
+    return cnt;
+failed:
+    free( data );
+    for ( i = 0; i < cnt; i++ ) blks[i] = run + i;
+    free_blks( blks, cnt );
+    return -1;
+}
+
+
+int sfs_defrag( char *fname )
+{
+    int res;
+    pthread_mutex_lock( &fs_lock );
+    res = meta_result( do_defrag( fname ) );
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+// Instrumentation. The API calls listed in SFS_OP_* are thin wrappers that time
+// the do_ functions above and record the latency with stat_op(). They also take
+// fs_lock, which serializes the API calls with the reclaimer, so the latency
+// includes any wait for it.
+uint64_t clock_us()
+{
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return ( uint64_t )t.tv_sec * 1000000 + t.tv_nsec/1000;
+}
+
+
+void stat_op( int op, uint64_t start )
+{
+    uint64_t us = clock_us() - start;
+    int b = us == 0 ? 0 : 64 - __builtin_clzll( us );
+    if ( b >= SFS_HIST_BUCKETS ) b = SFS_HIST_BUCKETS - 1;
+    STAT_ADD( ops[op].count, 1 );
+    STAT_ADD( ops[op].total_us, us );
+    STAT_ADD( ops[op].hist[b], 1 );
+}
+
+
+int sfs_fopen( char *fname )
+{
+    uint64_t start = clock_us();
+    pthread_mutex_lock( &fs_lock );
+    int res = meta_result( do_fopen( fname ) );
+    pthread_mutex_unlock( &fs_lock );
+    stat_op( SFS_OP_FOPEN, start );
+    return res;
+}
+
+
+int sfs_fwrite( int fileID, char *buf, int length )
+{
+    uint64_t start = clock_us();
+    pthread_mutex_lock( &fs_lock );
+    int res = meta_result( do_fwrite( fileID, buf, length ) );
+    pthread_mutex_unlock( &fs_lock );
+    stat_op( SFS_OP_FWRITE, start );
+    return res;
+}
+
+
+int sfs_fread( int fileID, char *buf, int length )
+{
+    uint64_t start = clock_us();
+    pthread_mutex_lock( &fs_lock );
+    int res = do_fread( fileID, buf, length );
+    pthread_mutex_unlock( &fs_lock );
+    stat_op( SFS_OP_FREAD, start );
+    return res;
+}
+
+
+// Reads up to length bytes at loc of fname without a file descriptor, as
+// sfs_snapshot_read() does for the snapshot. sfs_fopen() hands out one
+// descriptor per file, so callers reading one file from several threads at
+// once, such as the FUSE wrapper, would otherwise share its position.
+// @return the number of bytes read, or -1 on failure.
+int sfs_pread( char *fname, int loc, char *buf, int length )
+{
+    uint64_t start = clock_us();
+    int k, res = -1;
+    if ( !read_only ) pthread_mutex_lock( &fs_lock );
+    if ( loc >= 0 && ( k = find_file( fname ) ) != -1 )
+        res = read_at( mem_dir[k].inode, loc, buf, length );
+    if ( !read_only ) pthread_mutex_unlock( &fs_lock );
+    stat_op( SFS_OP_FREAD, start );
+    return res;
+}
+
+
+int sfs_fseek( int fileID, int loc )
+{
+    uint64_t start = clock_us();
+    pthread_mutex_lock( &fs_lock );
+    int res = do_fseek( fileID, loc );
+    pthread_mutex_unlock( &fs_lock );
+    stat_op( SFS_OP_FSEEK, start );
+    return res;
+}
+
+
+int sfs_flseek( int fileID, int offset, int whence )
+{
+    uint64_t start = clock_us();
+    pthread_mutex_lock( &fs_lock );
+    int res = do_flseek( fileID, offset, whence );
+    pthread_mutex_unlock( &fs_lock );
+    stat_op( SFS_OP_FSEEK, start );
+    return res;
+}
+
+
+int sfs_ftruncate( int fileID, int size )
+{
+    uint64_t start = clock_us();
+    pthread_mutex_lock( &fs_lock );
+    int res = meta_result( do_ftruncate( fileID, size ) );
+    pthread_mutex_unlock( &fs_lock );
+    stat_op( SFS_OP_FTRUNCATE, start );
+    return res;
+}
+
+
+int sfs_remove( char *fname )
+{
+    uint64_t start = clock_us();
+    pthread_mutex_lock( &fs_lock );
+    int res = meta_result( do_remove( fname ) );
+    pthread_mutex_unlock( &fs_lock );
+    stat_op( SFS_OP_REMOVE, start );
+    return res;
+}
+
+
+// Copies the counters into st. The block totals are taken from the disk
+// emulator and everything that is not a data block is counted as metadata.
+void sfs_get_stats( sfs_stats_t *st )
+{
+    unsigned long nread, nwritten;
+    disk_get_counters( &nread, &nwritten );
+    memcpy( st, &stats, sizeof( stats ) );
+    st -> blks_read = nread - base_blks_read;
+    st -> blks_written = nwritten - base_blks_written;
+    st -> meta_blks_read = st -> blks_read - st -> data_blks_read;
+    st -> meta_blks_written = st -> blks_written - st -> data_blks_written;
+}
+
+
+void sfs_reset_stats( void )
+{
+    memset( &stats, 0, sizeof( stats ) );
+    disk_get_counters( &base_blks_read, &base_blks_written );
+}
+
+
+// Formats the counters as text, one "name value" line per counter and one line
+// per API call giving its count, total time and histogram buckets. This is
+// what the FUSE wrapper serves as /.sfs_stats.
+// @return the length of the text, which is truncated if it does not fit in
+// len bytes, as with snprintf().
+int sfs_format_stats( char *buf, int len )
+{
+    static const char *names[SFS_NUM_OPS] = 
+        { "fopen", "fread", "fwrite", "fseek", "remove", "ftruncate" };
+    sfs_stats_t st;
+    int op, b, n = 0;
+    sfs_get_stats( &st );
+
+    // Appends to buf without running past its end while still counting the
+    // full length.
+#define APPEND(...) \
+    n += snprintf( buf + ( n < len ? n : len ), n < len ? len - n : 0, \
+                   __VA_ARGS__ )
+    for ( op = 0; op < SFS_NUM_OPS; op++ ) {
+        APPEND( "%s count %llu total_us %llu hist", names[op],
+                ( unsigned long long )st.ops[op].count,
+                ( unsigned long long )st.ops[op].total_us );
+        for ( b = 0; b < SFS_HIST_BUCKETS; b++ )
+            APPEND( " %llu", ( unsigned long long )st.ops[op].hist[b] );
+        APPEND( "\n" );
+    }
+    APPEND( "blks_read %llu\n", ( unsigned long long )st.blks_read );
+    APPEND( "blks_written %llu\n", ( unsigned long long )st.blks_written );
+    APPEND( "data_blks_read %llu\n", ( unsigned long long )st.data_blks_read );
+    APPEND( "data_blks_written %llu\n", 
+            ( unsigned long long )st.data_blks_written );
+    APPEND( "meta_blks_read %llu\n", ( unsigned long long )st.meta_blks_read );
+    APPEND( "meta_blks_written %llu\n", 
+            ( unsigned long long )st.meta_blks_written );
+    APPEND( "rmw %llu\n", ( unsigned long long )st.rmw );
+    APPEND( "cache_hits %llu\n", ( unsigned long long )st.cache_hits );
+    APPEND( "cache_misses %llu\n", ( unsigned long long )st.cache_misses );
+    APPEND( "dedup_hits %llu\n", ( unsigned long long )st.dedup_hits );
+    APPEND( "cow %llu\n", ( unsigned long long )st.cow );
+    APPEND( "csum_errors %llu\n", ( unsigned long long )st.csum_errors );
+#undef APPEND
+    return n;
+}
+
+
+// Creates fname like sfs_fopen() and, when size_hint is larger than what fits
+// inline, reserves a contiguous run of blocks for the whole file up front, laid
+// out as sfs_defrag() would. The file stays empty; the reserved blocks are
+// zeroed, since a later truncate or a write past the end exposes them as part
+// of the file, and are used by later writes and freed with the file. The
+// zeroing is one request for the run, or two around the indirect block, so it
+// costs about as much as writing the file once. If no free run is long enough,
+// or it fails to be zeroed, the file is simply allocated block by block as it
+// is written. An existing
+// file is opened as by sfs_fopen() without reserving anything, as is a file
+// that will be compressed, since how many blocks it takes is not known.
+// @return the fileID of the file that was opened, or -1 on failure.
+int do_fcreate( char *fname, int size_hint )
+{
+    int fileID, ino, i, nblks, cnt;
+    uint32_t run, blks[MAX_FILE_SIZE/BLOCK_SIZE + 1];
+    uint8_t *zeros;
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    if ( find_file( fname ) != -1 || size_hint <= INLINE_MAX || 
+         cur_codec != SFS_CODEC_NONE )
+        return do_fopen( fname );
+    if ( check_writable() == -1 ) return -1;
+    if ( size_hint > MAX_FILE_SIZE ) {
+        perror( "Size hint exceeds maximum file size.\n" );
+        return -1;
+    }
+    if ( ( fileID = do_fopen( fname ) ) == -1 ) return -1;
+    ino = fdt[fileID].inode;
+    inode_t *n = &table[ino];
+    nblks = ( size_hint + BLOCK_SIZE - 1 )/BLOCK_SIZE;
+    cnt = nblks > 12 ? nblks + 1 : nblks;
+    if ( ( run = alloc_run( INODE_GROUP( ino ), cnt ) ) == 0 ) return fileID;
+    zeros = calloc( nblks, BLOCK_SIZE );
+    if ( write_data( run, nblks < 12 ? nblks : 12, zeros ) == -1 ||
+         ( nblks > 12 && write_data( run + 13, nblks - 12, zeros ) == -1 ) ) {
+        free( zeros );
+        for ( i = 0; i < cnt; i++ ) blks[i] = run + i;
+        free_blks( blks, cnt );
+        return fileID;
+    }
+    free( zeros );
+    n -> flags &= ~INODE_INLINE;
+    for ( i = 0; i < nblks && i < 12; i++ ) n -> blk_ptr[i] = run + i;
+    if ( nblks > 12 ) {
+        n -> indirect = run + 12;
+        memset( blk_indices, 0, BLOCK_SIZE );
+        for ( i = 12; i < nblks; i++ ) blk_indices[i - 12] = run + i + 1;
+        write_indirect( n -> indirect, blk_indices );
+    }
+    mark_inode( ino );
+    persist_bitmap();
+    persist_inodes();
+    return fileID;
+}
+
+
+int sfs_fcreate( char *fname, int size_hint )
+{
+    int res;
+    pthread_mutex_lock( &fs_lock );
+    res = meta_result( do_fcreate( fname, size_hint ) );
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+// Registers codec under id so that files can be compressed with it. The id is
+// stored with the data, so a program reading a volume must register its codecs
+// under the same ids as the one that wrote it.
+// @return 0 on success or -1 if id is out of range or already taken.
+int sfs_register_codec( int id, const sfs_codec_t *codec )
+{
+    int res = -1;
+    pthread_mutex_lock( &fs_lock );
+    if ( id > SFS_CODEC_NONE && id < SFS_MAX_CODECS && codecs[id] == NULL ) {
+        codecs[id] = codec;
+        res = 0;
+    }
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+// Selects the codec that files created from now on are compressed with, or
+// with SFS_CODEC_NONE stops compressing new files. Existing files keep the
+// codec they were created with.
+// @return 0 on success or -1 if no codec is registered under id.
+int sfs_set_codec( int id )
+{
+    int res = -1;
+    pthread_mutex_lock( &fs_lock );
+    if ( id == SFS_CODEC_NONE || 
+         ( id > SFS_CODEC_NONE && id < SFS_MAX_CODECS && codecs[id] != NULL ) ) {
+        cur_codec = id;
+        res = 0;
+    }
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+// Fills in st for the file fname. The size of a file over the bytes stored is
+// the compression ratio it gets.
+// @return 0 on success or -1 if the file does not exist.
+int sfs_file_stats( char *fname, sfs_file_stats_t *st )
+{
+    int k, ino, c, i, nlblks, mapped;
+    uint32_t ptr[CLUSTER_BLKS];
+    pthread_mutex_lock( &fs_lock );
+    if ( ( k = find_file( fname ) ) == -1 ) {
+        pthread_mutex_unlock( &fs_lock );
+        return -1;
+    }
+    ino = mem_dir[k].inode;
+    inode_t *n = &table[ino];
+    memset( st, 0, sizeof( *st ) );
+    st -> size = n -> size;
+    st -> codec = INODE_CODEC( n );
+    nlblks = n -> indirect ? MAX_FILE_SIZE/BLOCK_SIZE : 12;
+    for ( c = 0; !( n -> flags & INODE_INLINE ) && c * CLUSTER_BLKS < nlblks; 
+          c++ ) {
+        get_cluster_ptrs( ino, c, ptr );
+        for ( mapped = 0, i = 0; i < CLUSTER_BLKS; i++ ) {
+            if ( ptr[i] == 0 ) continue;
+            mapped = 1;
+            if ( ptr[i] & CLUSTER_TAG ) {
+                st -> packed++;
+                continue;
+            }
+            st -> stored += BLOCK_SIZE;
+            if ( blk_ref( ptr[i] ) -> refs > 0 ) st -> shared += BLOCK_SIZE;
+        }
+        if ( mapped && st -> codec != SFS_CODEC_NONE ) st -> clusters++;
+    }
+    pthread_mutex_unlock( &fs_lock );
+    return 0;
+}
+
+
+// Turns dedup mode on or off for the data written from now on. Blocks already
+// shared stay shared, and are copied on write whether dedup is on or not.
+// @return 0.
+int sfs_set_dedup( int on )
+{
+    pthread_mutex_lock( &fs_lock );
+    dedup = on != 0;
+    pthread_mutex_unlock( &fs_lock );
+    return 0;
+}
+
+
+// Gives a data block one more reference. Unmapped slots and the tags of
+// packed clusters are skipped.
+void share_blk( uint32_t blk )
+{
+    if ( blk == 0 || ( blk & CLUSTER_TAG ) ) return;
+    blk_ref( blk ) -> refs++;
+    refs_dirty |= 1 << BLK_GROUP( blk );
+}
+
+
+// Creates dst as a clone of src: a new inode pointing to the same data blocks,
+// each of which gains a reference, so only the inode and the indirect block
+// are written however large the file is. Either file copies a shared block
+// the first time it writes to it. dst must not exist yet and is left closed.
+// @return 0 on success or -1 on failure.
+int do_clone( char *src, char *dst )
+{
+    int k, fileID, sino, ino, i;
+    uint32_t ind = 0;
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    if ( check_writable() == -1 ) return -1;
+    if ( ( k = find_file( src ) ) == -1 ) {
+        perror( "File to clone does not exist.\n" );
+        return -1;
+    }
+    if ( find_file( dst ) != -1 ) {
+        perror( "Clone destination already exists.\n" );
+        return -1;
+    }
+    sino = mem_dir[k].inode;
+    inode_t *s = &table[sino];
+    if ( clu_ino == sino && flush_cluster() == -1 ) return -1;
+    if ( !( s -> flags & INODE_INLINE ) && s -> indirect != 0 &&
+         ( ind = alloc_blk_near( INODE_GROUP( sino ), s -> indirect ) ) == 0 ) {
+        perror( "Disk is full.\n" );
+        return -1;
+    }
+    if ( ( fileID = do_fopen( dst ) ) == -1 ) {
+        if ( ind != 0 ) free_blks( &ind, 1 );
+        return -1;
+    }
+    ino = fdt[fileID].inode;
+    fdt[fileID].inode = 0;
+    inode_t *n = &table[ino];
+    memcpy( n, s, sizeof( inode_t ) );
+    if ( !( n -> flags & INODE_INLINE ) ) {
+        for ( i = 0; i < 12; i++ ) share_blk( n -> blk_ptr[i] );
+        if ( ind != 0 ) {
+            read_indirect( s -> indirect, blk_indices );
+            for ( i = 0; i < MAX_LBLKS - 12; i++ ) share_blk( blk_indices[i] );
+            write_indirect( ind, blk_indices );
+            n -> indirect = ind;
+        }
+    }
+    mark_inode( ino );
+
+    // The new references go out before the inode that holds them.
+    persist_refs();
+    persist_inodes();
+    persist_bitmap();
+    return 0;
+}
+
+
+int sfs_clone( char *src, char *dst )
+{
+    pthread_mutex_lock( &fs_lock );
+    int res = meta_result( do_clone( src, dst ) );
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+// Takes a snapshot of the volume as it is now. The inode table and directory
+// are written to a run of SNAP_BLKS blocks and every indirect block is copied,
+// while the data blocks are not copied at all but gain a reference each. The
+// cost therefore grows with the number of blocks in use: every mapped block
+// has its count raised in memory, and the reference table of every group that
+// holds one is written out. The disk writes are bounded by the number of
+// files and groups, and no data is read or copied. Creation in constant time
+// would need blocks shared lazily, with an epoch checked on every write to
+// decide when to copy, which the reference counts used by clones and dedup
+// do not provide. Only one snapshot is kept at a time.
+// @return 0 on success, -1 if there already is a snapshot or the disk is full.
+int do_snapshot()
+{
+    int ino, i, ncopies = 0;
+    uint32_t run, copies[NUM_INODES + SNAP_BLKS];
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    snap_root_t root;
+    if ( check_writable() == -1 ) return -1;
+    if ( sb.snap_root != 0 ) {
+        perror( "There already is a snapshot.\n" );
+        return -1;
+    }
+    if ( clu_ino != 0 && flush_cluster() == -1 ) return -1;
+    load_dir();
+    if ( ( run = alloc_run( 0, SNAP_BLKS ) ) == 0 ) {
+        perror( "Disk is full.\n" );
+        return -1;
+    }
+    memcpy( snap_table, table, sizeof( snap_table ) );
+    memcpy( snap_dir, mem_dir, sizeof( snap_dir ) );
+    memset( &snap_table[sb.root_dir_inode], 0, sizeof( inode_t ) );
+    for ( ino = 1; ino < NUM_INODES; ino++ ) {
+        inode_t *n = &snap_table[ino];
+        if ( n -> flags & INODE_ORPHAN ) memset( n, 0, sizeof( inode_t ) );
+        if ( n -> link_cnt == 0 || ( n -> flags & INODE_INLINE ) || 
+             n -> indirect == 0 ) 
+            continue;
+        if ( ( copies[ncopies] = alloc_blk_near( INODE_GROUP( ino ), 
+                                                 n -> indirect ) ) == 0 ) {
+            perror( "Disk is full.\n" );
+            for ( i = 0; i < SNAP_BLKS; i++ ) copies[ncopies++] = run + i;
+            free_blks( copies, ncopies );
+            return -1;
+        }
+        read_indirect( n -> indirect, blk_indices );
+        write_indirect( copies[ncopies], blk_indices );
+        n -> indirect = copies[ncopies++];
+    }
+    for ( ino = 1; ino < NUM_INODES; ino++ ) {
+        inode_t *n = &table[ino];
+        if ( snap_table[ino].link_cnt == 0 || ( n -> flags & INODE_INLINE ) ) 
+            continue;
+        for ( i = 0; i < 12; i++ ) share_blk( n -> blk_ptr[i] );
+        if ( n -> indirect == 0 ) continue;
+        read_indirect( n -> indirect, blk_indices );
+        for ( i = 0; i < MAX_LBLKS - 12; i++ ) share_blk( blk_indices[i] );
+    }
+
+    // The snapshot is written and the references it holds taken before the
+    // super block points to it.
+    sb.snap_root = run;
+    root.magic = SNAP_MAGIC;
+    root.created = time( NULL );
+    write_meta( run, &root, sizeof( root ) );
+    write_meta( run + 1, snap_table, sizeof( snap_table ) );
+    write_meta( run + 1 + SNAP_INODE_BLKS, snap_dir, sizeof( snap_dir ) );
+    persist_refs();
+    sb_mark_dirty();
+    write_meta( 0, &sb, sizeof( sb ) );
+    persist_bitmap();
+    snap_loaded = 1;
+    snap_cur = 0;
+    return 0;
+}
+
+
+// Loads the inode table and directory of the snapshot on first use.
+// @return 0 on success or -1 if there is no snapshot.
+int snap_load()
+{
+    snap_root_t root;
+    if ( snap_loaded ) return 0;
+    if ( sb.snap_root == 0 ) return -1;
+    read_meta( sb.snap_root, &root, sizeof( root ) );
+    if ( root.magic != SNAP_MAGIC ) {
+        perror( "Snapshot is corrupt.\n" );
+        return -1;
+    }
+    read_meta( sb.snap_root + 1, snap_table, sizeof( snap_table ) );
+    read_meta( sb.snap_root + 1 + SNAP_INODE_BLKS, snap_dir, 
+               sizeof( snap_dir ) );
+    snap_loaded = 1;
+    snap_cur = 0;
+    return 0;
+}
+
+
+// Looks fname up in the directory of the snapshot.
+// @return its inode, or -1 if it is not in the snapshot.
+int snap_find( const char *fname )
+{
+    int k;
+    if ( snap_load() == -1 ) return -1;
+    for ( k = 0; k < NUM_INODES - 1; k++ )
+        if ( snap_dir[k].inode != 0 && strcmp( snap_dir[k].filename, fname ) == 0 )
+            return snap_dir[k].inode;
+    return -1;
+}
+
+
+// Deletes the snapshot, dropping the references it holds, so that blocks only
+// it still used are freed along with its own blocks.
+// @return 0 on success or -1 if there is no snapshot.
+int do_snapshot_drop()
+{
+    int ino, i, cnt = 0;
+    uint32_t *list;
+    unsigned int blk_indices[BLOCK_SIZE/sizeof( unsigned int )];
+    if ( check_writable() == -1 ) return -1;
+    if ( snap_load() == -1 ) {
+        perror( "There is no snapshot.\n" );
+        return -1;
+    }
+    list = malloc( ( NUM_BLOCKS + SNAP_BLKS ) * sizeof( uint32_t ) );
+    for ( ino = 1; ino < NUM_INODES; ino++ ) {
+        inode_t *n = &snap_table[ino];
+        if ( n -> link_cnt == 0 || ( n -> flags & INODE_INLINE ) ) continue;
+        for ( i = 0; i < 12; i++ )
+            if ( n -> blk_ptr[i] != 0 && !( n -> blk_ptr[i] & CLUSTER_TAG ) )
+                list[cnt++] = n -> blk_ptr[i];
+        if ( n -> indirect == 0 ) continue;
+        read_indirect( n -> indirect, blk_indices );
+        for ( i = 0; i < MAX_LBLKS - 12; i++ )
+            if ( blk_indices[i] != 0 && !( blk_indices[i] & CLUSTER_TAG ) )
+                list[cnt++] = blk_indices[i];
+        list[cnt++] = n -> indirect;
+    }
+    for ( i = 0; i < SNAP_BLKS; i++ ) list[cnt++] = sb.snap_root + i;
+    if ( clu_ino == SNAP_INO ) clu_ino = 0;
+    sb.snap_root = 0;
+    sb_mark_dirty();
+    write_meta( 0, &sb, sizeof( sb ) );
+    free_blks( list, cnt );
+    persist_bitmap();
+    free( list );
+    snap_loaded = 0;
+    return 0;
+}
+
+
+int sfs_snapshot( void )
+{
+    pthread_mutex_lock( &fs_lock );
+    int res = meta_result( do_snapshot() );
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+int sfs_snapshot_drop( void )
+{
+    pthread_mutex_lock( &fs_lock );
+    int res = meta_result( do_snapshot_drop() );
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+// Works like sfs_getnextfilename() on the directory of the snapshot.
+int sfs_snapshot_getnextfilename( char *fname )
+{
+    int found = 0;
+    pthread_mutex_lock( &fs_lock );
+    if ( snap_load() == 0 ) {
+        while ( snap_dir_i < NUM_INODES - 1 && snap_dir[snap_dir_i].inode == 0 ) 
+            snap_dir_i++;
+        if ( snap_dir_i == NUM_INODES - 1 ) {
+            snap_dir_i = 0;
+        } else {
+            strcpy( fname, snap_dir[snap_dir_i].filename );
+            snap_dir_i++;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock( &fs_lock );
+    return found;
+}
+
+
+int sfs_snapshot_getfilesize( const char *fname )
+{
+    int ino, size = -1;
+    pthread_mutex_lock( &fs_lock );
+    if ( ( ino = snap_find( fname ) ) != -1 ) size = snap_table[ino].size;
+    pthread_mutex_unlock( &fs_lock );
+    return size;
+}
+
+
+// Reads up to length bytes at loc of fname as it was when the snapshot was
+// taken. There are no file descriptors for snapshot files, so the position is
+// passed in with every read.
+// @return the number of bytes read, or -1 on failure.
+int sfs_snapshot_read( char *fname, int loc, char *buf, int length )
+{
+    int ino, res = -1;
+    pthread_mutex_lock( &fs_lock );
+    if ( loc >= 0 && ( ino = snap_find( fname ) ) != -1 ) {
+        if ( ino != snap_cur ) {
+            if ( clu_ino == SNAP_INO ) clu_ino = 0;
+            memcpy( &table[SNAP_INO], &snap_table[ino], sizeof( inode_t ) );
+            snap_cur = ino;
+        }
+        res = read_at( SNAP_INO, loc, buf, length );
+    }
+    pthread_mutex_unlock( &fs_lock );
+    return res;
+}
+
+
+// Turns checksums on or off for the data blocks written from now on. Blocks
+// written while they were on keep being checked when read until they are
+// written again with them off.
+// @return 0.
+int sfs_set_checksums( int on )
+{
+    pthread_mutex_lock( &fs_lock );
+    csum_on = on != 0;
+    pthread_mutex_unlock( &fs_lock );
+    return 0;
+}
@@ -10,11 +10,35 @@
 #ifndef _INCLUDE_SFS_API_H_
 #define _INCLUDE_SFS_API_H_
 #include <stdint.h>
+#include "sfs_codec.h"
 
 
 // Function macro for printing error messages and exiting with EXIT_FAIILURE
 #define die(msg) { perror( msg ); exit( EXIT_FAILURE ); }
 
+// The maximum number of block groups the super block has room to summarize.
+#define SFS_MAX_GROUPS 16
+
+// The size of a buffer large enough for a filename as passed in by the FUSE
+// wrapper, with its leading '/' and the null byte.
+#define MAXFILENAME 22
+
+// Values of whence for sfs_flseek().
+enum { SFS_SEEK_SET, SFS_SEEK_CUR, SFS_SEEK_END, SFS_SEEK_DATA, 
+       SFS_SEEK_HOLE };
+
+// The API calls timed by the instrumentation, and the number of buckets in
+// their latency histograms.
+enum { SFS_OP_FOPEN, SFS_OP_FREAD, SFS_OP_FWRITE, SFS_OP_FSEEK, SFS_OP_REMOVE,
+       SFS_OP_FTRUNCATE, SFS_NUM_OPS };
+#define SFS_HIST_BUCKETS 24
+
+// Tags attached to every block request when the disk emulator is tracing (see
+// disk_set_tag()), saying which structure the blocks belong to.
+enum { SFS_TAG_NONE, SFS_TAG_SUPER, SFS_TAG_BITMAP, SFS_TAG_INODE, SFS_TAG_DIR,
+       SFS_TAG_INDIRECT, SFS_TAG_DATA, SFS_TAG_REFS, SFS_TAG_SNAP, 
+       SFS_NUM_TAGS };
+
 
 /* 
  * A struct representing an inode needs to be made that contains fields for the
@@ -25,6 +49,13 @@
  * to store both the inode of a file and the rw_ptr of that file.
  * A struct representing a directory entry is also created that stores a 
  * filename as well as the inode of a file
+ *
+ * The super block also carries a checkpoint of the free space summary. The
+ * counters are only trusted on mount if the clean flag is set, which only
+ * happens when the file system was closed with sfs_unmount(); otherwise they
+ * are rebuilt from the free bitmap and inode table the first time the bitmap
+ * is needed. snap_root is the first block of the snapshot taken by
+ * sfs_snapshot(), or 0 if there is none.
  */
  typedef struct {
     uint32_t magic_num;
@@ -32,17 +63,53 @@
     uint32_t fs_size;
     uint32_t inode_table_len;
     uint32_t root_dir_inode;
+    uint32_t clean;
+    uint32_t free_blk_cnt;
+    uint32_t free_inode_cnt;
+    uint32_t num_groups;
+    uint32_t grp_free_blks[SFS_MAX_GROUPS];
+    uint32_t grp_free_inodes[SFS_MAX_GROUPS];
+    uint32_t snap_root;
  } super_block_t;
 
 
+// A file of at most INLINE_MAX bytes has the INODE_INLINE flag set and keeps
+// its contents in the inode itself, in the space of the block pointers, so it
+// needs no data block. The file is moved to a data block when a write makes it
+// larger than that.
+#define INODE_INLINE 0x1
+// A removed file whose directory entry is gone but whose blocks have not yet
+// been freed by the reclaimer.
+#define INODE_ORPHAN 0x2
+
+// A file created while a codec was selected with sfs_set_codec() keeps the
+// codec's id in bits 8 to 15 of its flags, and its data is compressed in
+// clusters of CLUSTER_BLKS logical blocks (fewer for the last cluster a file
+// of the maximum size can have). A cluster that packs into fewer blocks than
+// it would take as is is stored in the first of its slots, and the pointer in
+// its last slot holds CLUSTER_TAG, the codec id and the packed length instead
+// of a block number. Other clusters are stored as is.
+#define INODE_CODEC(n) ( ( ( n ) -> flags >> 8 ) & 0xff )
+#define CLUSTER_BLKS 8
+#define CLUSTER_TAG 0x80000000
+#define CLUSTER_CODEC(p) ( ( ( p ) >> 16 ) & 0xff )
+#define CLUSTER_LEN(p) ( ( p ) & 0xffff )
+#define INLINE_MAX ( 13 * sizeof( unsigned int ) )
+
 typedef struct  {
     unsigned int mode;
     unsigned int link_cnt;
     unsigned int uid;
     unsigned int gid;
     unsigned int size;
-    unsigned int blk_ptr[12];
-    unsigned int indirect;
+    unsigned int flags;
+    union {
+        struct {
+            unsigned int blk_ptr[12];
+            unsigned int indirect;
+        };
+        char data[INLINE_MAX];
+    };
 } inode_t;
 
 
@@ -52,6 +119,24 @@ typedef struct {
 } file_descriptor_t;
 
 
+// Every block has an entry in the reference table of its group. refs counts
+// the references to the block beyond the first, from dedup or sfs_clone(), so
+// a block that is not shared has 0 and is freed when it is dropped, while a
+// shared one only loses a reference. A block written in dedup mode has
+// REF_HASHED set and the hash of its contents in hash, which is what the dedup
+// index is rebuilt from. A data block written with checksums on has REF_CSUM
+// set and the CRC32C of its contents in crc, which is checked whenever it is
+// read.
+#define REF_HASHED 0x1
+#define REF_CSUM 0x2
+
+typedef struct {
+    uint32_t hash;
+    uint32_t crc;
+    uint16_t refs;
+    uint16_t flags;
+} blk_ref_t;
+
 
 typedef struct {
     // The total length of the filename is 20 for a maximum filname length of 
@@ -62,16 +147,94 @@ typedef struct {
 } dir_entry_t;
 
 
+/*
+ * Counters reported by sfs_get_stats(). Each API call in SFS_OP_* has a call
+ * count, its total time and a histogram of its latency in which bucket 0
+ * counts calls that took less than 1us and bucket b counts calls that took
+ * between 2^(b-1) and 2^b us; the last bucket also holds everything slower.
+ * Block counters come from the disk emulator and are split into data blocks
+ * (file contents moved by sfs_fread(), sfs_fwrite() and sfs_defrag()) and
+ * metadata blocks (everything else). rmw counts partial block writes that had
+ * to read the block first, and the cache counters refer to the cached copy of
+ * the last indirect block used. dedup_hits counts blocks written in dedup mode
+ * that were shared with an identical block instead of being stored, and cow
+ * the shared blocks that were copied because they were written to.
+ * csum_errors counts data blocks read whose checksum did not match.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t hist[SFS_HIST_BUCKETS];
+} sfs_op_stats_t;
+
+
+typedef struct {
+    sfs_op_stats_t ops[SFS_NUM_OPS];
+    uint64_t blks_read;
+    uint64_t blks_written;
+    uint64_t data_blks_read;
+    uint64_t data_blks_written;
+    uint64_t meta_blks_read;
+    uint64_t meta_blks_written;
+    uint64_t rmw;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t dedup_hits;
+    uint64_t cow;
+    uint64_t csum_errors;
+} sfs_stats_t;
+
+
+// Per-file figures reported by sfs_file_stats(). stored is the size of the
+// data blocks the file takes, not counting its indirect block, and clusters
+// the clusters of a compressed file that hold data, of which packed were
+// stored compressed. shared is how much of stored is in blocks the file
+// shares with other files or with other parts of itself.
+typedef struct {
+    uint32_t size;
+    uint32_t stored;
+    uint32_t codec;
+    uint32_t clusters;
+    uint32_t packed;
+    uint32_t shared;
+} sfs_file_stats_t;
+
+
 // Declared function prototypes
 void mksfs( int fresh );
+void mksfs_ro( void );
 int sfs_getnextfilename( char *fname );
 int sfs_getfilesize( const char *path );
+uint64_t sfs_getmtime( const char *path );
 int sfs_fopen(char *name );
+int sfs_fcreate( char *fname, int size_hint );
 int sfs_fclose( int fileID );
 int sfs_fwrite( int fileID, char *buf, int length ); 
 int sfs_fread( int fileID, char *buf, int length ); 
+int sfs_pread( char *fname, int loc, char *buf, int length );
 int sfs_fseek( int fileID, int loc );
+int sfs_flseek( int fileID, int offset, int whence );
 int sfs_remove( char *file );
+int sfs_ftruncate( int fileID, int size );
+int sfs_statfs( uint32_t *free_blks, uint32_t *free_inodes );
+int sfs_unmount( void );
+void sfs_flush_reservations( void );
+int sfs_fragments( char *fname );
+int sfs_defrag( char *fname );
+void sfs_get_stats( sfs_stats_t *st );
+void sfs_reset_stats( void );
+int sfs_format_stats( char *buf, int len );
+int sfs_register_codec( int id, const sfs_codec_t *codec );
+int sfs_set_codec( int id );
+int sfs_file_stats( char *fname, sfs_file_stats_t *st );
+int sfs_set_dedup( int on );
+int sfs_clone( char *src, char *dst );
+int sfs_set_checksums( int on );
+int sfs_snapshot( void );
+int sfs_snapshot_drop( void );
+int sfs_snapshot_getnextfilename( char *fname );
+int sfs_snapshot_getfilesize( const char *fname );
+int sfs_snapshot_read( char *fname, int loc, char *buf, int length );
 
 
 #endif
@@ -0,0 +1,266 @@
+/* sfs_bench.c
+ *
+ * Microbenchmarks for the sfs_api.h interface. Unlike sfs_test.c and
+ * sfs_test2.c, which check correctness with random names and sizes, every
+ * run here does the same work so that results can be compared between
+ * changes to sfs_api.c. Results are printed to stdout as one JSON object:
+ *
+ *   seq_write / seq_read / rand_write / rand_read
+ *       throughput in MB/s for each I/O size in IO_SIZES
+ *   meta
+ *       create, open and remove operations per second
+ *   append_latency_us
+ *       latency percentiles of small appends
+ *   checksum
+ *       CRC32C speed in GB/s of the implementation in use and of the table
+ *       fallback, and sequential read throughput with and without checksums
+ *   mount
+ *       time to mount and answer sfs_statfs() for clean and unclean volumes
+ *       at several fill levels
+ *
+ * Usage: sfs_bench > results.json
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sfs_api.h"
+#include "sfs_crc.h"
+
+#define FILE_BYTES (128 * 1024)  /* Size of the file used for throughput */
+#define NUM_META 48              /* Files created for the metadata test */
+#define NUM_APPENDS 1000         /* Appends for the latency test */
+#define APPEND_BYTES 45          /* Size of one append */
+#define CRC_ROUNDS 2000          /* Passes over buf when timing CRC32C */
+
+static int IO_SIZES[] = { 64, 512, 1024, 4096, 16384 };
+#define NUM_IO_SIZES (sizeof(IO_SIZES) / sizeof(IO_SIZES[0]))
+
+static char buf[FILE_BYTES];
+
+double now_us()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+double mbps(long bytes, double us)
+{
+  return us > 0 ? bytes / us * 1e6 / (1024 * 1024) : 0;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* bench_io() - time one pass over a FILE_BYTES file in io-sized requests,
+ * either in order or in a shuffled order of io-aligned offsets.
+ */
+double bench_io(int fd, int io, int write, int random)
+{
+  int nops = FILE_BYTES / io;
+  int *order = malloc(nops * sizeof(int));
+  int i, j, tmp;
+  double t0;
+
+  for (i = 0; i < nops; i++) {
+    order[i] = i;
+  }
+  if (random) {
+    for (i = nops - 1; i > 0; i--) {
+      j = rand() % (i + 1);
+      tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+  }
+  t0 = now_us();
+  for (i = 0; i < nops; i++) {
+    sfs_fseek(fd, order[i] * io);
+    if (write) {
+      sfs_fwrite(fd, buf, io);
+    }
+    else {
+      sfs_fread(fd, buf, io);
+    }
+  }
+  free(order);
+  return mbps((long)nops * io, now_us() - t0);
+}
+
+void bench_throughput()
+{
+  const char *names[] = { "seq_write", "seq_read", "rand_write", "rand_read" };
+  int kind, i, fd;
+
+  for (kind = 0; kind < 4; kind++) {
+    printf("  \"%s\": {", names[kind]);
+    for (i = 0; i < NUM_IO_SIZES; i++) {
+      mksfs(1);
+      fd = sfs_fopen("bench.dat");
+      /* Reads and random writes need the file to exist first. */
+      if (kind != 0) {
+        bench_io(fd, 4096, 1, 0);
+      }
+      printf("%s\"%d\": %.2f", i ? ", " : "", IO_SIZES[i],
+             bench_io(fd, IO_SIZES[i], kind % 2 == 0, kind >= 2));
+      sfs_fclose(fd);
+      sfs_unmount();
+    }
+    printf("},\n");
+  }
+}
+
+void bench_meta()
+{
+  char names[NUM_META][21];
+  double t0, create, open, remove;
+  int i;
+
+  mksfs(1);
+  for (i = 0; i < NUM_META; i++) {
+    sprintf(names[i], "meta%d.txt", i);
+  }
+  t0 = now_us();
+  for (i = 0; i < NUM_META; i++) {
+    sfs_fclose(sfs_fopen(names[i]));
+  }
+  create = now_us() - t0;
+  t0 = now_us();
+  for (i = 0; i < NUM_META; i++) {
+    sfs_fclose(sfs_fopen(names[i]));
+  }
+  open = now_us() - t0;
+  t0 = now_us();
+  for (i = 0; i < NUM_META; i++) {
+    sfs_remove(names[i]);
+  }
+  remove = now_us() - t0;
+  sfs_unmount();
+  printf("  \"meta\": {\"create_ops\": %.0f, \"open_ops\": %.0f, "
+         "\"remove_ops\": %.0f},\n", NUM_META / create * 1e6,
+         NUM_META / open * 1e6, NUM_META / remove * 1e6);
+}
+
+void bench_append()
+{
+  static double lat[NUM_APPENDS];
+  double t0;
+  int i, fd;
+
+  mksfs(1);
+  fd = sfs_fopen("append.log");
+  for (i = 0; i < NUM_APPENDS; i++) {
+    t0 = now_us();
+    sfs_fwrite(fd, buf, APPEND_BYTES);
+    lat[i] = now_us() - t0;
+  }
+  sfs_fclose(fd);
+  sfs_unmount();
+  qsort(lat, NUM_APPENDS, sizeof(double), cmp_double);
+  printf("  \"append_latency_us\": {\"bytes\": %d, \"p50\": %.1f, "
+         "\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n", APPEND_BYTES,
+         lat[NUM_APPENDS / 2], lat[NUM_APPENDS * 9 / 10],
+         lat[NUM_APPENDS * 99 / 100], lat[NUM_APPENDS - 1]);
+}
+
+/* crc_gbps() - time CRC32C over buf in 1 KiB blocks, as the checksums are
+ * taken, and return GB/s.
+ */
+double crc_gbps(uint32_t (*crc)(uint32_t, const void *, size_t))
+{
+  volatile uint32_t sink = 0;
+  double t0, us;
+  int r, off;
+
+  t0 = now_us();
+  for (r = 0; r < CRC_ROUNDS; r++) {
+    for (off = 0; off < FILE_BYTES; off += 1024) {
+      sink ^= crc(0, buf + off, 1024);
+    }
+  }
+  us = now_us() - t0;
+  return us > 0 ? (double)CRC_ROUNDS * FILE_BYTES / us / 1e3 : 0;
+}
+
+/* bench_checksum() - the read throughput is measured at 4096 bytes, the size
+ * the FUSE wrapper is usually asked for.
+ */
+void bench_checksum()
+{
+  double read_mbps[2];
+  int on, fd;
+
+  printf("  \"checksum\": {\"impl\": \"%s\", \"crc32c_gbps\": %.2f, "
+         "\"table_gbps\": %.2f", sfs_crc32c_impl(), crc_gbps(sfs_crc32c),
+         crc_gbps(sfs_crc32c_sw));
+  for (on = 0; on < 2; on++) {
+    mksfs(1);
+    sfs_set_checksums(on);
+    fd = sfs_fopen("bench.dat");
+    bench_io(fd, 4096, 1, 0);
+    read_mbps[on] = bench_io(fd, 4096, 0, 0);
+    sfs_fclose(fd);
+    sfs_unmount();
+  }
+  sfs_set_checksums(0);
+  printf(", \"seq_read_mbps\": %.2f, \"seq_read_verify_mbps\": %.2f},\n",
+         read_mbps[0], read_mbps[1]);
+}
+
+/* bench_mount() - the volume size is fixed at compile time, so mount time is
+ * measured against how full the volume is instead: clean mounts should stay
+ * flat, while unclean mounts pay for a scan when the counters are needed.
+ */
+void bench_mount()
+{
+  uint32_t free_blks, total_blks;
+  int fill, fd, clean;
+  double t0, us;
+  char name[21];
+
+  mksfs(1);
+  sfs_statfs(&total_blks, NULL);
+  sfs_unmount();
+  printf("  \"mount\": {\"data_blocks\": %u, \"points\": [", total_blks);
+  for (fill = 0; fill <= 75; fill += 25) {
+    for (clean = 1; clean >= 0; clean--) {
+      mksfs(1);
+      for (fd = 0; fd * (FILE_BYTES / 1024) < total_blks * fill / 100; fd++) {
+        sprintf(name, "fill%d.dat", fd);
+        int f = sfs_fopen(name);
+        sfs_fwrite(f, buf, FILE_BYTES);
+        sfs_fclose(f);
+      }
+      if (clean) {
+        sfs_unmount();
+      }
+      t0 = now_us();
+      mksfs(0);
+      sfs_statfs(&free_blks, NULL);
+      us = now_us() - t0;
+      sfs_unmount();
+      printf("%s{\"fill_pct\": %d, \"clean\": %s, \"mount_us\": %.1f}",
+             fill || !clean ? ", " : "", fill, clean ? "true" : "false", us);
+    }
+  }
+  printf("]}\n");
+}
+
+int main(int argc, char **argv)
+{
+  srand(310);
+  memset(buf, 'x', sizeof(buf));
+  printf("{\n");
+  bench_throughput();
+  bench_meta();
+  bench_append();
+  bench_checksum();
+  bench_mount();
+  printf("}\n");
+  return EXIT_SUCCESS;
+}
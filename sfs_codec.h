@@ -0,0 +1,36 @@
+/* sfs_codec.h
+ *
+ * The interface between sfs_api.c and the compressors it can store file data
+ * with. A codec is identified on disk by a small id, so a file keeps being
+ * readable as long as the codec it was written with is registered under the
+ * same id.
+ */
+#ifndef _INCLUDE_SFS_CODEC_H_
+#define _INCLUDE_SFS_CODEC_H_
+#include <stdint.h>
+
+
+// Codec ids. SFS_CODEC_NONE turns compression off; ids up to SFS_MAX_CODECS - 1
+// that are not built in are free for sfs_register_codec().
+#define SFS_CODEC_NONE 0
+#define SFS_CODEC_LZ 1
+#define SFS_MAX_CODECS 16
+
+
+// compress() packs len bytes of src into dst, which has room for cap bytes,
+// and returns the packed length, or 0 if it would not fit in cap bytes.
+// decompress() unpacks len bytes of src into dst, which has room for cap
+// bytes, and returns the unpacked length, or -1 if src is not valid packed
+// data. Both are only ever called with fs_lock held.
+typedef struct {
+    const char *name;
+    int ( *compress )( const uint8_t *src, int len, uint8_t *dst, int cap );
+    int ( *decompress )( const uint8_t *src, int len, uint8_t *dst, int cap );
+} sfs_codec_t;
+
+
+// A byte-oriented LZ77 codec in the style of LZ4, defined in sfs_lz.c.
+extern const sfs_codec_t sfs_codec_lz;
+
+
+#endif
@@ -0,0 +1,134 @@
+/* sfs_crc.c
+ *
+ * CRC32C, picking the fastest implementation the CPU supports the first time
+ * it is called. The table implementation processes 8 bytes per step with 8
+ * tables of 256 entries (slicing-by-8); the hardware ones feed the CRC32
+ * instruction 8 bytes at a time, which on current CPUs checks a block in well
+ * under a microsecond.
+ */
+#include <pthread.h>
+#include <string.h>
+
+#include "sfs_crc.h"
+
+#if defined( __x86_64__ )
+#include <nmmintrin.h>
+#elif defined( __aarch64__ ) && defined( __ARM_FEATURE_CRC32 )
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78   /* Reflected Castagnoli polynomial */
+
+static uint32_t crc_table[8][256];
+static uint32_t ( *crc_impl )( uint32_t, const uint8_t *, size_t );
+static const char *crc_impl_name;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+
+static uint32_t crc_slice8( uint32_t crc, const uint8_t *p, size_t len )
+{
+    uint64_t w;
+    while ( len > 0 && ( ( uintptr_t )p & 7 ) ) {
+        crc = crc_table[0][( crc ^ *p++ ) & 0xff] ^ ( crc >> 8 );
+        len--;
+    }
+    while ( len >= 8 ) {
+        memcpy( &w, p, sizeof( w ) );
+        w ^= crc;
+        crc = crc_table[7][w & 0xff] ^ crc_table[6][( w >> 8 ) & 0xff] ^
+              crc_table[5][( w >> 16 ) & 0xff] ^ crc_table[4][( w >> 24 ) & 0xff] ^
+              crc_table[3][( w >> 32 ) & 0xff] ^ crc_table[2][( w >> 40 ) & 0xff] ^
+              crc_table[1][( w >> 48 ) & 0xff] ^ crc_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while ( len-- > 0 ) crc = crc_table[0][( crc ^ *p++ ) & 0xff] ^ ( crc >> 8 );
+    return crc;
+}
+
+
+#if defined( __x86_64__ )
+__attribute__(( target( "sse4.2" ) ))
+static uint32_t crc_hw( uint32_t crc, const uint8_t *p, size_t len )
+{
+    uint64_t c = crc, w;
+    while ( len > 0 && ( ( uintptr_t )p & 7 ) ) {
+        c = _mm_crc32_u8( c, *p++ );
+        len--;
+    }
+    while ( len >= 8 ) {
+        memcpy( &w, p, sizeof( w ) );
+        c = _mm_crc32_u64( c, w );
+        p += 8;
+        len -= 8;
+    }
+    while ( len-- > 0 ) c = _mm_crc32_u8( c, *p++ );
+    return c;
+}
+#elif defined( __aarch64__ ) && defined( __ARM_FEATURE_CRC32 )
+static uint32_t crc_hw( uint32_t crc, const uint8_t *p, size_t len )
+{
+    uint64_t w;
+    while ( len > 0 && ( ( uintptr_t )p & 7 ) ) {
+        crc = __crc32cb( crc, *p++ );
+        len--;
+    }
+    while ( len >= 8 ) {
+        memcpy( &w, p, sizeof( w ) );
+        crc = __crc32cd( crc, w );
+        p += 8;
+        len -= 8;
+    }
+    while ( len-- > 0 ) crc = __crc32cb( crc, *p++ );
+    return crc;
+}
+#endif
+
+
+static void crc_init( void )
+{
+    uint32_t crc;
+    int i, j;
+    for ( i = 0; i < 256; i++ ) {
+        crc = i;
+        for ( j = 0; j < 8; j++ ) 
+            crc = crc & 1 ? ( crc >> 1 ) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][i] = crc;
+    }
+    for ( i = 0; i < 256; i++ )
+        for ( j = 1; j < 8; j++ )
+            crc_table[j][i] = crc_table[0][crc_table[j - 1][i] & 0xff] ^
+                              ( crc_table[j - 1][i] >> 8 );
+    crc_impl = crc_slice8;
+    crc_impl_name = "table";
+#if defined( __x86_64__ )
+    if ( __builtin_cpu_supports( "sse4.2" ) ) {
+        crc_impl = crc_hw;
+        crc_impl_name = "sse4.2";
+    }
+#elif defined( __aarch64__ ) && defined( __ARM_FEATURE_CRC32 )
+    crc_impl = crc_hw;
+    crc_impl_name = "armv8";
+#endif
+}
+
+
+uint32_t sfs_crc32c( uint32_t crc, const void *buf, size_t len )
+{
+    pthread_once( &crc_once, crc_init );
+    return ~crc_impl( ~crc, buf, len );
+}
+
+
+uint32_t sfs_crc32c_sw( uint32_t crc, const void *buf, size_t len )
+{
+    pthread_once( &crc_once, crc_init );
+    return ~crc_slice8( ~crc, buf, len );
+}
+
+
+const char *sfs_crc32c_impl( void )
+{
+    pthread_once( &crc_once, crc_init );
+    return crc_impl_name;
+}
@@ -0,0 +1,23 @@
+/* sfs_crc.h
+ *
+ * CRC32C (the Castagnoli polynomial used by iSCSI, ext4 and btrfs) for the
+ * block checksums kept by sfs_api.c. sfs_crc32c() uses the CRC instructions
+ * of SSE 4.2 or ARMv8 when the CPU has them and a table otherwise.
+ */
+#ifndef _INCLUDE_SFS_CRC_H_
+#define _INCLUDE_SFS_CRC_H_
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Extends crc, the CRC32C of some earlier bytes or 0 to start, over len bytes
+// of buf. sfs_crc32c_sw() always uses the table, so the two can be compared.
+uint32_t sfs_crc32c( uint32_t crc, const void *buf, size_t len );
+uint32_t sfs_crc32c_sw( uint32_t crc, const void *buf, size_t len );
+
+// The name of the implementation sfs_crc32c() uses: "sse4.2", "armv8" or
+// "table".
+const char *sfs_crc32c_impl( void );
+
+
+#endif
@@ -0,0 +1,95 @@
+/* sfs_defrag.c
+ *
+ * Defragments the files of an existing SFS disk image. Every file named on the
+ * command line, or every file on the disk if none are named, is moved into a
+ * single contiguous run of blocks with sfs_defrag(). For each file the number
+ * of runs it is made of and its sequential read throughput are reported before
+ * and after the move.
+ *
+ * Usage: sfs_defrag [filename ...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sfs_api.h"
+
+#define CHUNK 4096      /* Bytes per sfs_fread() call when timing reads */
+#define ROUNDS 8        /* Number of times the file is read when timing */
+
+/* read_mbps() - read the whole file ROUNDS times from the start and return
+ * the sequential read throughput in MB/s, or -1 if the file can't be read.
+ */
+double read_mbps(char *fname)
+{
+  char buf[CHUNK];
+  struct timespec t0, t1;
+  long total = 0;
+  int fd, i, n;
+  double secs;
+
+  if ((fd = sfs_fopen(fname)) < 0) {
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < ROUNDS; i++) {
+    sfs_fseek(fd, 0);
+    while ((n = sfs_fread(fd, buf, CHUNK)) > 0) {
+      total += n;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  sfs_fclose(fd);
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  if (secs <= 0) {
+    return 0;
+  }
+  return total / secs / (1024 * 1024);
+}
+
+int defrag_one(char *fname)
+{
+  int runs_before, runs_after, moved;
+  double before, after;
+
+  runs_before = sfs_fragments(fname);
+  if (runs_before < 0) {
+    fprintf(stderr, "%s: no such file\n", fname);
+    return -1;
+  }
+  before = read_mbps(fname);
+  moved = sfs_defrag(fname);
+  if (moved < 0) {
+    fprintf(stderr, "%s: defragmentation failed\n", fname);
+    return -1;
+  }
+  runs_after = sfs_fragments(fname);
+  after = read_mbps(fname);
+  printf("%-20s runs %3d -> %3d  blocks moved %4d  read %8.2f -> %8.2f MB/s\n",
+         fname, runs_before, runs_after, moved, before, after);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char names[64][21];
+  int i, n = 0, errors = 0;
+
+  mksfs(0);
+  if (argc > 1) {
+    for (i = 1; i < argc; i++) {
+      errors += defrag_one(argv[i]) != 0;
+    }
+  }
+  else {
+    while (n < 64 && sfs_getnextfilename(names[n])) {
+      n++;
+    }
+    for (i = 0; i < n; i++) {
+      errors += defrag_one(names[i]) != 0;
+    }
+  }
+  sfs_unmount();
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+/* sfs_export.c
+ *
+ * Copies every file of the SFS disk image in the current directory out to a
+ * host directory, which is created if it does not exist. Each file is read
+ * with a single sfs_fread() of its whole size, so the data of a contiguous
+ * file comes off the disk in one request. With -s the files of the snapshot
+ * taken by sfs_snapshot() are exported instead of the live ones.
+ *
+ * Usage: sfs_export [-s] dir
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "sfs_api.h"
+
+/* read_file() - read the whole of fname, live or from the snapshot, into buf.
+ * @return the number of bytes read, or -1.
+ */
+int read_file(char *fname, char *buf, int size, int snap)
+{
+  int fd, n;
+
+  if (snap) {
+    return sfs_snapshot_read(fname, 0, buf, size);
+  }
+  if ((fd = sfs_fopen(fname)) < 0) {
+    return -1;
+  }
+  /* Files open at their end, for appending. */
+  sfs_fseek(fd, 0);
+  n = sfs_fread(fd, buf, size);
+  sfs_fclose(fd);
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  char fname[MAXFILENAME], path[4096], *buf;
+  struct timespec t0, t1;
+  int opt, snap = 0, files = 0, failed = 0, size, n, out;
+  long long bytes = 0;
+
+  while ((opt = getopt(argc, argv, "s")) != -1) {
+    if (opt != 's') {
+      fprintf(stderr, "usage: %s [-s] dir\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+    snap = 1;
+  }
+  if (argc - optind != 1) {
+    fprintf(stderr, "usage: %s [-s] dir\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (mkdir(argv[optind], 0755) == -1 && errno != EEXIST) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  mksfs(0);
+  while (snap ? sfs_snapshot_getnextfilename(fname) :
+                sfs_getnextfilename(fname)) {
+    size = snap ? sfs_snapshot_getfilesize(fname) : sfs_getfilesize(fname);
+    snprintf(path, sizeof(path), "%s/%s", argv[optind], fname);
+    buf = malloc(size > 0 ? size : 1);
+    if (size < 0 || (n = read_file(fname, buf, size, snap)) != size ||
+        (out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+      fprintf(stderr, "%s: could not be exported\n", fname);
+      failed++;
+      free(buf);
+      continue;
+    }
+    if (write(out, buf, size) != size) {
+      perror(path);
+      failed++;
+    }
+    else {
+      files++;
+      bytes += size;
+    }
+    close(out);
+    free(buf);
+  }
+  sfs_unmount();
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  printf("%s: %d files, %lld bytes exported, %d failed, in %.3f ms\n",
+         argv[optind], files, bytes, failed,
+         (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
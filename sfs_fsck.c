@@ -0,0 +1,541 @@
+/* sfs_fsck.c
+ *
+ * Checks the consistency of an SFS disk image without mounting it, and can
+ * repair what it finds. The image is read directly with the layout in
+ * sfs_layout.h. The inodes, those of the snapshot included, are split between
+ * worker threads, each of which follows the block pointers of its inodes and
+ * counts the references to every block in a shared table. The counts are then
+ * checked against
+ *
+ *   the free bitmap        every referenced block must be marked used, and
+ *                          every used data block referenced
+ *   the reference tables   a block referenced n times must record n - 1
+ *                          extra references
+ *   the directory          every entry must name a live inode, and every live
+ *                          inode other than an orphan must have one
+ *   the super block        the free block and inode counters, if it claims
+ *                          the volume was cleanly unmounted
+ *
+ * Pointers outside the disk or into the metadata of a group are reported too.
+ * With -y the problems are fixed in place: bad pointers are cleared, leaked
+ * blocks freed, referenced blocks marked used, reference counts set to what
+ * was found, bad directory entries dropped and inodes without one flagged as
+ * orphans for the next mount to reclaim. The super block is then marked
+ * unclean so that its counters are rebuilt on mount. The snapshot is checked
+ * but never changed.
+ *
+ * The exit status is 0 for a clean image, 1 if problems were fixed, 4 if
+ * problems were left and 8 if the image could not be checked.
+ *
+ * Usage: sfs_fsck [-y] [-j threads] [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sfs_layout.h"
+
+#define PTRS_PER_BLK (BLOCK_SIZE / sizeof(unsigned int))
+
+/* An inode to check: one of the live ones, or one of the snapshot's. */
+typedef struct {
+  inode_t *n;
+  int ino;
+  int snap;
+} item_t;
+
+static int img;
+static int repair;
+static super_block_t sb;
+static inode_t table[NUM_INODES], snap_table[NUM_INODES];
+static dir_entry_t dir[NUM_INODES - 1], snap_dir[NUM_INODES - 1];
+static uint8_t bitmap[NUM_BLOCKS / 8];
+static blk_ref_t refs[NUM_BLOCKS];
+static uint32_t counts[NUM_BLOCKS];
+static uint8_t is_indirect[NUM_BLOCKS];
+static item_t items[2 * NUM_INODES];
+static int nitems, nthreads;
+static int found, fixed;
+static int inodes_dirty, bitmap_dirty, refs_dirty, dir_dirty;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* problem() - report one problem, and whether it is being fixed. */
+void problem(int fixing, const char *fmt, ...)
+{
+  va_list ap;
+
+  pthread_mutex_lock(&report_lock);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf(fixing ? " (fixed)\n" : "\n");
+  found++;
+  fixed += fixing;
+  pthread_mutex_unlock(&report_lock);
+}
+
+/* read_meta() / write_meta() - transfer len bytes starting at block addr,
+ * going through whole blocks as the disk does.
+ */
+int read_meta(uint32_t addr, void *dst, size_t len)
+{
+  int nblks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint8_t *buf = calloc(nblks, BLOCK_SIZE);
+  ssize_t res = pread(img, buf, nblks * BLOCK_SIZE, (off_t)addr * BLOCK_SIZE);
+
+  memcpy(dst, buf, len);
+  free(buf);
+  return res == nblks * BLOCK_SIZE ? 0 : -1;
+}
+
+int write_meta(uint32_t addr, const void *src, size_t len)
+{
+  int nblks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint8_t *buf = calloc(nblks, BLOCK_SIZE);
+  ssize_t res;
+
+  /* Keep whatever follows len in the last block. */
+  pread(img, buf, nblks * BLOCK_SIZE, (off_t)addr * BLOCK_SIZE);
+  memcpy(buf, src, len);
+  res = pwrite(img, buf, nblks * BLOCK_SIZE, (off_t)addr * BLOCK_SIZE);
+  free(buf);
+  return res == nblks * BLOCK_SIZE ? 0 : -1;
+}
+
+int is_free(uint32_t blk)
+{
+  return (bitmap[blk / 8] >> (blk % 8)) & 1;
+}
+
+int is_data_blk(uint32_t blk)
+{
+  return blk < NUM_BLOCKS && blk % BLKS_PER_GRP >= GRP_DATA_START;
+}
+
+/* dir_blk_addr() - the address of directory block b, from the root inode. */
+uint32_t dir_blk_addr(int b)
+{
+  unsigned int ind[PTRS_PER_BLK];
+  inode_t *root = &table[sb.root_dir_inode];
+
+  if (b < 12) {
+    return root->blk_ptr[b];
+  }
+  if (!is_data_blk(root->indirect) ||
+      read_meta(root->indirect, ind, BLOCK_SIZE) == -1) {
+    return 0;
+  }
+  return ind[b - 12];
+}
+
+/* load_image() - read the super block, the metadata of every group, the
+ * directory and the snapshot.
+ */
+int load_image()
+{
+  snap_root_t root;
+  uint32_t addr;
+  int g, b, n;
+
+  if (read_meta(0, &sb, sizeof(sb)) == -1 || sb.magic_num != MAGIC_NUM ||
+      sb.num_groups != NUM_GROUPS) {
+    fprintf(stderr, "not an SFS image of this version\n");
+    return -1;
+  }
+  for (g = 0; g < NUM_GROUPS; g++) {
+    if (read_meta(GRP_BITMAP_ADDR(g), bitmap + g * GRP_BITMAP_BYTES,
+                  GRP_BITMAP_BYTES) == -1 ||
+        read_meta(GRP_INODE_ADDR(g), table + g * INODES_PER_GRP,
+                  INODES_PER_GRP * sizeof(inode_t)) == -1 ||
+        read_meta(GRP_REF_ADDR(g), refs + GRP_BASE(g),
+                  BLKS_PER_GRP * sizeof(blk_ref_t)) == -1) {
+      fprintf(stderr, "cannot read the metadata of group %d\n", g);
+      return -1;
+    }
+  }
+  for (b = 0; b < NO_DIR_BLKS; b++) {
+    n = NUM_INODES - 1 - b * DIR_PER_BLK;
+    n = n > DIR_PER_BLK ? DIR_PER_BLK : n;
+    addr = dir_blk_addr(b);
+    if (!is_data_blk(addr) ||
+        read_meta(addr, dir + b * DIR_PER_BLK, n * sizeof(dir_entry_t)) == -1) {
+      fprintf(stderr, "directory block %d is missing\n", b);
+      return -1;
+    }
+  }
+  if (sb.snap_root != 0) {
+    if (sb.snap_root + SNAP_BLKS > NUM_BLOCKS ||
+        read_meta(sb.snap_root, &root, sizeof(root)) == -1 ||
+        root.magic != SNAP_MAGIC) {
+      problem(0, "super block points to a bad snapshot at %u", sb.snap_root);
+      sb.snap_root = 0;
+      return 0;
+    }
+    read_meta(sb.snap_root + 1, snap_table, sizeof(snap_table));
+    read_meta(sb.snap_root + 1 + SNAP_INODE_BLKS, snap_dir, sizeof(snap_dir));
+  }
+  return 0;
+}
+
+/* check_ptr() - count one reference to *p, found at index i of the inode's
+ * block pointers. A pointer that can not be right is reported and, when
+ * repairing a live inode, cleared.
+ * @return 1 if *p was cleared.
+ */
+int check_ptr(item_t *it, unsigned int *p, int i)
+{
+  inode_t *n = it->n;
+  int fix = repair && !it->snap;
+  int last;
+
+  if (*p == 0) {
+    return 0;
+  }
+  if (*p & CLUSTER_TAG) {
+    /* A tag is only valid in the last slot of a cluster of a compressed file,
+     * and its packed length must fit in the slots before it.
+     */
+    last = i % CLUSTER_BLKS == CLUSTER_BLKS - 1 || i == MAX_LBLKS - 1;
+    if (INODE_CODEC(n) != 0 && last &&
+        CLUSTER_LEN(*p) <= (i % CLUSTER_BLKS) * BLOCK_SIZE) {
+      return 0;
+    }
+    problem(fix, "%sinode %d: bad cluster tag %#x at block %d",
+            it->snap ? "snapshot " : "", it->ino, *p, i);
+  }
+  else if (!is_data_blk(*p)) {
+    problem(fix, "%sinode %d: block %d points to %u, outside the data area",
+            it->snap ? "snapshot " : "", it->ino, i, *p);
+  }
+  else {
+    __atomic_fetch_add(&counts[*p], 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  if (fix) {
+    *p = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/* check_inode() - follow every block pointer of one inode. */
+void check_inode(item_t *it)
+{
+  inode_t *n = it->n;
+  unsigned int ind[PTRS_PER_BLK];
+  int i, fix = repair && !it->snap, changed = 0;
+  const char *kind = it->snap ? "snapshot " : "";
+
+  if (n->link_cnt == 0) {
+    return;
+  }
+  if (n->flags & INODE_INLINE) {
+    if (n->size > INLINE_MAX) {
+      problem(0, "%sinode %d: inline file of %u bytes", kind, it->ino,
+              n->size);
+    }
+    return;
+  }
+  if (n->size > MAX_FILE_SIZE) {
+    problem(0, "%sinode %d: size %u is past the maximum", kind, it->ino,
+            n->size);
+  }
+  for (i = 0; i < 12; i++) {
+    changed |= check_ptr(it, &n->blk_ptr[i], i);
+  }
+  if (n->indirect == 0) {
+    goto out;
+  }
+  if (!is_data_blk(n->indirect)) {
+    problem(fix, "%sinode %d: indirect block %u is outside the data area",
+            kind, it->ino, n->indirect);
+    if (fix) {
+      n->indirect = 0;
+      changed = 1;
+    }
+    goto out;
+  }
+  __atomic_fetch_add(&counts[n->indirect], 1, __ATOMIC_RELAXED);
+  is_indirect[n->indirect] = 1;
+  if (read_meta(n->indirect, ind, BLOCK_SIZE) == -1) {
+    problem(0, "%sinode %d: cannot read indirect block %u", kind, it->ino,
+            n->indirect);
+    goto out;
+  }
+  for (i = 0; i < MAX_LBLKS - 12; i++) {
+    if (check_ptr(it, &ind[i], i + 12)) {
+      write_meta(n->indirect, ind, BLOCK_SIZE);
+    }
+  }
+out:
+  if (changed) {
+    __atomic_store_n(&inodes_dirty, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void *worker(void *arg)
+{
+  long t = (long)arg;
+  int i;
+
+  for (i = t; i < nitems; i += nthreads) {
+    check_inode(&items[i]);
+  }
+  return NULL;
+}
+
+/* check_blocks() - compare the reference counts with the free bitmap and the
+ * reference tables.
+ */
+void check_blocks(int *referenced, int *shared)
+{
+  uint32_t blk, c;
+
+  for (blk = 0; blk < NUM_BLOCKS; blk++) {
+    c = counts[blk];
+    if (!is_data_blk(blk)) {
+      if (is_free(blk)) {
+        problem(repair, "metadata block %u is marked free", blk);
+        bitmap[blk / 8] &= ~(1 << (blk % 8));
+        bitmap_dirty = 1;
+      }
+      continue;
+    }
+    *referenced += c > 0;
+    *shared += c > 1;
+    if (c == 0 && !is_free(blk)) {
+      problem(repair, "block %u is marked used but nothing points to it", blk);
+      if (repair) {
+        bitmap[blk / 8] |= 1 << (blk % 8);
+        bitmap_dirty = 1;
+      }
+    }
+    if (c > 0 && is_free(blk)) {
+      problem(repair, "block %u is in use but marked free", blk);
+      if (repair) {
+        bitmap[blk / 8] &= ~(1 << (blk % 8));
+        bitmap_dirty = 1;
+      }
+    }
+    if (is_indirect[blk] && c > 1) {
+      problem(0, "indirect block %u is pointed to %u times", blk, c);
+      continue;
+    }
+    if ((c > 0 ? c - 1 : 0) != refs[blk].refs) {
+      problem(repair, "block %u is pointed to %u times but records %u "
+              "extra references", blk, c, refs[blk].refs);
+      if (repair) {
+        refs[blk].refs = c > 0 ? c - 1 : 0;
+        refs_dirty = 1;
+      }
+    }
+    if (c == 0 && refs[blk].flags != 0 && repair) {
+      memset(&refs[blk], 0, sizeof(blk_ref_t));
+      refs_dirty = 1;
+    }
+  }
+}
+
+/* check_dir() - check the entries of a directory against its inodes. */
+void check_dir(dir_entry_t *d, inode_t *t, int snap)
+{
+  int seen[NUM_INODES] = { 0 };
+  int k, j, ino, fix = repair && !snap;
+  const char *kind = snap ? "snapshot " : "";
+
+  for (k = 0; k < NUM_INODES - 1; k++) {
+    ino = d[k].inode;
+    if (ino == 0) {
+      continue;
+    }
+    if (memchr(d[k].filename, '\0', sizeof(d[k].filename)) == NULL) {
+      problem(fix, "%sdirectory entry %d has no terminated name", kind, k);
+    }
+    else if (ino >= NUM_INODES || ino == sb.root_dir_inode) {
+      problem(fix, "%sdirectory entry %s points to inode %d", kind,
+              d[k].filename, ino);
+    }
+    else if (t[ino].link_cnt == 0 || (t[ino].flags & INODE_ORPHAN)) {
+      problem(fix, "%sdirectory entry %s points to free inode %d", kind,
+              d[k].filename, ino);
+    }
+    else if (seen[ino]++) {
+      problem(fix, "%sinode %d has a second directory entry %s", kind, ino,
+              d[k].filename);
+    }
+    else {
+      for (j = 0; j < k && (d[j].inode == 0 ||
+                            strcmp(d[j].filename, d[k].filename)); j++)
+        ;
+      if (j == k) {
+        continue;
+      }
+      problem(fix, "%sdirectory has %s twice", kind, d[k].filename);
+      seen[ino]--;
+    }
+    if (fix) {
+      memset(&d[k], 0, sizeof(dir_entry_t));
+      dir_dirty = 1;
+    }
+  }
+  for (ino = 0; ino < NUM_INODES; ino++) {
+    if (ino == sb.root_dir_inode || t[ino].link_cnt == 0 ||
+        (t[ino].flags & INODE_ORPHAN) || seen[ino]) {
+      continue;
+    }
+    problem(fix, "%sinode %d has no directory entry", kind, ino);
+    if (fix) {
+      t[ino].flags |= INODE_ORPHAN;
+      inodes_dirty = 1;
+    }
+  }
+}
+
+/* check_counters() - the counters in a clean super block are trusted on
+ * mount, so they have to match the bitmap and the inode table.
+ */
+void check_counters()
+{
+  uint32_t free_blks = 0, free_inodes = 0, blk;
+  int ino;
+
+  for (blk = 0; blk < NUM_BLOCKS; blk++) {
+    free_blks += is_free(blk);
+  }
+  for (ino = 1; ino < NUM_INODES; ino++) {
+    free_inodes += table[ino].link_cnt == 0;
+  }
+  if (sb.clean && (sb.free_blk_cnt != free_blks ||
+                   sb.free_inode_cnt != free_inodes)) {
+    problem(repair, "super block counts %u free blocks and %u free inodes, "
+            "not %u and %u", sb.free_blk_cnt, sb.free_inode_cnt, free_blks,
+            free_inodes);
+  }
+}
+
+/* write_back() - write out what the repairs changed. The super block goes
+ * last and is marked unclean so that the next mount recounts.
+ */
+int write_back()
+{
+  int g, b, n, res = 0;
+
+  for (g = 0; g < NUM_GROUPS; g++) {
+    if (inodes_dirty) {
+      res |= write_meta(GRP_INODE_ADDR(g), table + g * INODES_PER_GRP,
+                        INODES_PER_GRP * sizeof(inode_t));
+    }
+    if (refs_dirty) {
+      res |= write_meta(GRP_REF_ADDR(g), refs + GRP_BASE(g),
+                        BLKS_PER_GRP * sizeof(blk_ref_t));
+    }
+    if (bitmap_dirty) {
+      res |= write_meta(GRP_BITMAP_ADDR(g), bitmap + g * GRP_BITMAP_BYTES,
+                        GRP_BITMAP_BYTES);
+    }
+  }
+  for (b = 0; dir_dirty && b < NO_DIR_BLKS; b++) {
+    n = NUM_INODES - 1 - b * DIR_PER_BLK;
+    n = n > DIR_PER_BLK ? DIR_PER_BLK : n;
+    res |= write_meta(dir_blk_addr(b), dir + b * DIR_PER_BLK,
+                      n * sizeof(dir_entry_t));
+  }
+  sb.clean = 0;
+  for (g = 0; g < NUM_GROUPS; g++) {
+    res |= write_meta(GRP_BASE(g), &sb, sizeof(sb));
+  }
+  return res;
+}
+
+int main(int argc, char **argv)
+{
+  char *image = DISK_NAME;
+  pthread_t tids[2 * NUM_INODES];   /* One per item at most */
+  struct timespec t0, t1;
+  int opt, i, referenced = 0, shared = 0, orphans = 0;
+  long t;
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "yj:")) != -1) {
+    if (opt == 'y') {
+      repair = 1;
+    }
+    else if (opt == 'j') {
+      nthreads = atoi(optarg);
+    }
+    else {
+      fprintf(stderr, "usage: %s [-y] [-j threads] [image]\n", argv[0]);
+      return 8;
+    }
+  }
+  if (optind < argc) {
+    image = argv[optind];
+  }
+  if ((img = open(image, repair ? O_RDWR : O_RDONLY)) < 0) {
+    perror(image);
+    return 8;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (load_image() == -1) {
+    close(img);
+    return 8;
+  }
+
+  /* The inodes of the snapshot are checked alongside the live ones, and the
+   * blocks of the snapshot itself count as referenced.
+   */
+  for (i = 0; i < NUM_INODES; i++) {
+    items[nitems++] = (item_t){ &table[i], i, 0 };
+    orphans += table[i].link_cnt != 0 && (table[i].flags & INODE_ORPHAN);
+  }
+  if (sb.snap_root != 0) {
+    for (i = 0; i < NUM_INODES; i++) {
+      items[nitems++] = (item_t){ &snap_table[i], i, 1 };
+    }
+    for (i = 0; i < SNAP_BLKS; i++) {
+      counts[sb.snap_root + i]++;
+    }
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > nitems) {
+    nthreads = nitems;
+  }
+  for (t = 0; t < nthreads; t++) {
+    pthread_create(&tids[t], NULL, worker, (void *)t);
+  }
+  for (t = 0; t < nthreads; t++) {
+    pthread_join(tids[t], NULL);
+  }
+
+  check_blocks(&referenced, &shared);
+  check_dir(dir, table, 0);
+  if (sb.snap_root != 0) {
+    check_dir(snap_dir, snap_table, 1);
+  }
+  check_counters();
+  if (repair && fixed > 0 && write_back() == -1) {
+    fprintf(stderr, "%s: writing the repairs failed\n", image);
+    close(img);
+    return 8;
+  }
+  close(img);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  printf("%s: %d inodes (%d orphans), %d blocks in use, %d shared%s\n", image,
+         NUM_INODES - 1, orphans, referenced, shared,
+         sb.snap_root ? ", with a snapshot" : "");
+  printf("%d problems, %d fixed, in %.3f ms with %d threads\n", found, fixed,
+         (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+         nthreads);
+  if (found == 0) {
+    return 0;
+  }
+  return fixed == found ? 1 : 4;
+}
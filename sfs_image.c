@@ -0,0 +1,269 @@
+/* sfs_image.c
+ *
+ * The in-memory image builder declared in sfs_image.h. The whole disk is one
+ * buffer that file data and indirect blocks are written to in place; the
+ * super block, bitmap, inode table, reference table and directory are kept in
+ * the structures sfs_api.c uses and copied into the buffer, slice by slice for
+ * every group, when the image is written.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sfs_image.h"
+#include "sfs_crc.h"
+
+#define BLK_ADDR(img, b) ( ( img ) -> disk + ( size_t )( b ) * BLOCK_SIZE )
+
+
+// The rules of check_filename() in sfs_api.c: at most 16 characters before the
+// first period and 3 after it, 20 in all.
+static int valid_name( const char *fname )
+{
+    const char *dot = strchr( fname, '.' );
+    size_t len = strlen( fname );
+    if ( len == 0 || len > 20 ) return 0;
+    if ( dot == NULL ) return len <= 16;
+    return dot - fname <= 16 && strlen( dot + 1 ) <= 3;
+}
+
+
+static int is_free( const sfs_image_t *img, uint32_t blk )
+{
+    return ( img -> bitmap[blk/8] >> ( blk % 8 ) ) & 1;
+}
+
+
+// Takes the first free block after goal, going on into the following groups
+// and wrapping around at the end of the disk.
+// @return the block, or 0 if the disk is full.
+static uint32_t take_blk( sfs_image_t *img, uint32_t goal )
+{
+    uint32_t i, blk;
+    for ( i = 1; i <= NUM_BLOCKS; i++ ) {
+        blk = ( goal + i ) % NUM_BLOCKS;
+        if ( !is_free( img, blk ) ) continue;
+        img -> bitmap[blk/8] &= ~( 1 << ( blk % 8 ) );
+        img -> sb.grp_free_blks[BLK_GROUP( blk )]--;
+        img -> sb.free_blk_cnt--;
+        return blk;
+    }
+    return 0;
+}
+
+
+// Gives inode n nblks data blocks, in the order sfs_fwrite() would allocate
+// them when writing the file from the start: the 12 direct blocks, the
+// indirect block, then the rest, starting from the first free block after
+// goal. The caller has checked that there are enough free blocks.
+// @return the last block taken.
+static uint32_t lay_out( sfs_image_t *img, inode_t *n, uint32_t nblks,
+                         uint32_t goal )
+{
+    unsigned int *ind = NULL;
+    uint32_t i, blk = goal;
+    for ( i = 0; i < nblks; i++ ) {
+        if ( i == 12 ) {
+            n -> indirect = blk = take_blk( img, blk );
+            ind = ( unsigned int * )BLK_ADDR( img, blk );
+        }
+        blk = take_blk( img, blk );
+        if ( i < 12 ) n -> blk_ptr[i] = blk;
+        else ind[i - 12] = blk;
+    }
+    return blk;
+}
+
+
+// Returns the block holding logical block lblk of a file laid out by
+// lay_out().
+static uint32_t map_blk( const sfs_image_t *img, const inode_t *n,
+                         uint32_t lblk )
+{
+    const unsigned int *ind;
+    if ( lblk < 12 ) return n -> blk_ptr[lblk];
+    ind = ( const unsigned int * )BLK_ADDR( img, n -> indirect );
+    return ind[lblk - 12];
+}
+
+
+int sfs_image_init( sfs_image_t *img, int checksums )
+{
+    inode_t *root;
+    int g, i;
+    memset( img, 0, sizeof( *img ) );
+    if ( ( img -> disk = calloc( NUM_BLOCKS, BLOCK_SIZE ) ) == NULL ) return -1;
+    img -> checksums = checksums;
+    img -> sb.magic_num = MAGIC_NUM;
+    img -> sb.block_size = BLOCK_SIZE;
+    img -> sb.fs_size = BLOCK_SIZE * NUM_BLOCKS;
+    img -> sb.inode_table_len = INODE_BLKS_PER_GRP;
+    img -> sb.root_dir_inode = 0;
+    img -> sb.num_groups = NUM_GROUPS;
+
+    // Every block but the metadata at the start of each group is free.
+    memset( img -> bitmap, UINT8_MAX, sizeof( img -> bitmap ) );
+    for ( g = 0; g < NUM_GROUPS; g++ ) {
+        for ( i = 0; i < GRP_DATA_START; i++ )
+            img -> bitmap[( GRP_BASE( g ) + i )/8] &=
+                ~( 1 << ( ( GRP_BASE( g ) + i ) % 8 ) );
+        img -> sb.grp_free_blks[g] = BLKS_PER_GRP - GRP_DATA_START;
+        img -> sb.grp_free_inodes[g] = INODES_PER_GRP;
+        img -> sb.free_blk_cnt += img -> sb.grp_free_blks[g];
+        img -> sb.free_inode_cnt += INODES_PER_GRP;
+    }
+
+    // The root directory takes the first data blocks of group 0, as in
+    // init_root_dir().
+    root = &img -> table[0];
+    root -> link_cnt = 1;
+    root -> mode = 0666;
+    root -> gid = 1;
+    root -> size = NO_DIR_BLKS * BLOCK_SIZE;
+    img -> last = lay_out( img, root, NO_DIR_BLKS, GRP_BASE( 0 ) );
+    img -> sb.grp_free_inodes[0]--;
+    img -> sb.free_inode_cnt--;
+    return 0;
+}
+
+
+// The group for a new inode, chosen as pick_inode_group() does: the one with
+// the most free blocks among those with a free inode.
+static int pick_group( const sfs_image_t *img )
+{
+    int g, best = -1;
+    for ( g = 0; g < NUM_GROUPS; g++ ) {
+        if ( img -> sb.grp_free_inodes[g] == 0 ) continue;
+        if ( best == -1 ||
+             img -> sb.grp_free_blks[g] > img -> sb.grp_free_blks[best] )
+            best = g;
+    }
+    return best;
+}
+
+
+int sfs_image_create( sfs_image_t *img, const char *fname, uint32_t size )
+{
+    uint32_t nblks = ( size + BLOCK_SIZE - 1 )/BLOCK_SIZE;
+    inode_t *n;
+    int ino, k, g;
+
+    if ( !valid_name( fname ) || size > MAX_FILE_SIZE ) return -1;
+    for ( k = 0; k < NUM_INODES - 1; k++ )
+        if ( img -> dir[k].inode != 0 &&
+             strcmp( img -> dir[k].filename, fname ) == 0 )
+            return -1;
+    for ( k = 0; k < NUM_INODES - 1 && img -> dir[k].inode != 0; k++ );
+    if ( k == NUM_INODES - 1 || ( g = pick_group( img ) ) == -1 ) return -1;
+    if ( size > INLINE_MAX && nblks + ( nblks > 12 ) > img -> sb.free_blk_cnt )
+        return -1;
+    if ( img -> packed ) g = 0;
+    for ( ino = g * INODES_PER_GRP; ino == img -> sb.root_dir_inode ||
+                                    img -> table[ino].link_cnt != 0; ino++ );
+    g = INODE_GROUP( ino );
+
+    n = &img -> table[ino];
+    n -> mode = 0666;
+    n -> link_cnt = 1;
+    n -> gid = 1;
+    n -> size = size;
+    if ( size <= INLINE_MAX ) n -> flags = INODE_INLINE;
+    else if ( img -> packed )
+        img -> last = lay_out( img, n, nblks, img -> last );
+    else
+        lay_out( img, n, nblks, GRP_BASE( g ) );
+    img -> sb.grp_free_inodes[g]--;
+    img -> sb.free_inode_cnt--;
+    img -> dir[k].inode = ino;
+    strcpy( img -> dir[k].filename, fname );
+    return ino;
+}
+
+
+int sfs_image_pwrite( sfs_image_t *img, int ino, uint32_t pos, const void *buf,
+                      uint32_t len )
+{
+    inode_t *n = &img -> table[ino];
+    uint32_t done, off, chunk, blk;
+    if ( pos > n -> size || len > n -> size - pos ) return -1;
+    if ( n -> flags & INODE_INLINE ) {
+        memcpy( n -> data + pos, buf, len );
+        return len;
+    }
+    for ( done = 0; done < len; done += chunk ) {
+        off = ( pos + done ) % BLOCK_SIZE;
+        chunk = BLOCK_SIZE - off < len - done ? BLOCK_SIZE - off : len - done;
+        blk = map_blk( img, n, ( pos + done )/BLOCK_SIZE );
+        memcpy( BLK_ADDR( img, blk ) + off, ( const uint8_t * )buf + done,
+                chunk );
+    }
+    return len;
+}
+
+
+// Records the checksum of every data block of the files, as write_data() does
+// with checksums on. Directory and indirect blocks are metadata and have none.
+static void sum_data( sfs_image_t *img )
+{
+    uint32_t i, blk;
+    inode_t *n;
+    int ino;
+    for ( ino = 1; ino < NUM_INODES; ino++ ) {
+        n = &img -> table[ino];
+        if ( n -> link_cnt == 0 || ( n -> flags & INODE_INLINE ) ) continue;
+        for ( i = 0; i < ( n -> size + BLOCK_SIZE - 1 )/BLOCK_SIZE; i++ ) {
+            blk = map_blk( img, n, i );
+            img -> refs[blk].crc = sfs_crc32c( 0, BLK_ADDR( img, blk ),
+                                               BLOCK_SIZE );
+            img -> refs[blk].flags |= REF_CSUM;
+        }
+    }
+}
+
+
+int sfs_image_write( sfs_image_t *img, const char *path )
+{
+    size_t done, len = ( size_t )NUM_BLOCKS * BLOCK_SIZE;
+    ssize_t res;
+    int fd, g, b, n;
+
+    if ( img -> checksums ) sum_data( img );
+    img -> sb.clean = 1;
+    for ( g = 0; g < NUM_GROUPS; g++ ) {
+        memcpy( BLK_ADDR( img, GRP_BASE( g ) ), &img -> sb,
+                sizeof( img -> sb ) );
+        memcpy( BLK_ADDR( img, GRP_BITMAP_ADDR( g ) ),
+                img -> bitmap + g * GRP_BITMAP_BYTES, GRP_BITMAP_BYTES );
+        memcpy( BLK_ADDR( img, GRP_INODE_ADDR( g ) ),
+                img -> table + g * INODES_PER_GRP,
+                INODES_PER_GRP * sizeof( inode_t ) );
+        memcpy( BLK_ADDR( img, GRP_REF_ADDR( g ) ), img -> refs + GRP_BASE( g ),
+                BLKS_PER_GRP * sizeof( blk_ref_t ) );
+    }
+    for ( b = 0; b < NO_DIR_BLKS; b++ ) {
+        n = NUM_INODES - 1 - b * DIR_PER_BLK;
+        n = n > DIR_PER_BLK ? DIR_PER_BLK : n;
+        memcpy( BLK_ADDR( img, map_blk( img, &img -> table[0], b ) ),
+                img -> dir + b * DIR_PER_BLK, n * sizeof( dir_entry_t ) );
+    }
+
+    if ( ( fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) < 0 )
+        return -1;
+    for ( done = 0; done < len; done += res ) {
+        if ( ( res = write( fd, img -> disk + done, len - done ) ) <= 0 ) {
+            if ( res == 0 ) errno = EIO;
+            close( fd );
+            return -1;
+        }
+    }
+    return close( fd );
+}
+
+
+void sfs_image_free( sfs_image_t *img )
+{
+    free( img -> disk );
+    img -> disk = NULL;
+}
@@ -0,0 +1,61 @@
+/* sfs_image.h
+ *
+ * Builds an SFS volume in memory, file contents included, and writes it out as
+ * a disk image in one sequential pass. This is for tools that provision images
+ * with many files, where going through sfs_fopen() and sfs_fwrite() would
+ * write the inode table, directory and bitmap again for every file. The image
+ * is the same as one written through sfs_api.c and cleanly unmounted, so it
+ * mounts with mksfs( 0 ) as usual.
+ */
+#ifndef _INCLUDE_SFS_IMAGE_H_
+#define _INCLUDE_SFS_IMAGE_H_
+#include <stdint.h>
+
+#include "sfs_layout.h"
+
+
+typedef struct {
+    super_block_t sb;
+    inode_t table[NUM_INODES];
+    dir_entry_t dir[NUM_INODES - 1];
+    uint8_t bitmap[NUM_BLOCKS/8];
+    blk_ref_t refs[NUM_BLOCKS];
+    uint8_t *disk;
+    int checksums;
+    int packed;
+    uint32_t last;
+} sfs_image_t;
+
+// Starts an empty volume laid out as mksfs( 1 ) would, keeping CRC32C
+// checksums of the data blocks if checksums is set.
+// @return 0, or -1 if there is no memory for the disk.
+int sfs_image_init( sfs_image_t *img, int checksums );
+
+// Creates a file of size bytes, filled with zeros, and reserves its blocks:
+// one run in the group of its inode if they fit, then the next free blocks of
+// the following groups. The indirect block, if one is needed, comes right
+// after the first 12 data blocks, where sfs_fwrite() would put it.
+//
+// If packed is set, files instead take the lowest free inode and their blocks
+// follow on from those of the file created before, so that files created in
+// order lie in one sequence over the disk, broken only by group metadata.
+// @return the inode of the file, or -1 if the name is not valid or taken, or
+// the inodes or blocks have run out.
+int sfs_image_create( sfs_image_t *img, const char *fname, uint32_t size );
+
+// Copies len bytes of buf to the file at ino, starting at pos. Calls for
+// different files, or different blocks of one file, may run in parallel.
+// @return len, or -1 if the range is past the size given to
+// sfs_image_create().
+int sfs_image_pwrite( sfs_image_t *img, int ino, uint32_t pos, const void *buf,
+                      uint32_t len );
+
+// Fills in the free space counters, the checksums and the copies of the super
+// block, then writes the whole disk to path with a single write.
+// @return 0, or -1 with errno set.
+int sfs_image_write( sfs_image_t *img, const char *path );
+
+void sfs_image_free( sfs_image_t *img );
+
+
+#endif
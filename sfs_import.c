@@ -0,0 +1,128 @@
+/* sfs_import.c
+ *
+ * Copies the regular files of a host directory into a new SFS disk image. The
+ * image is built in memory with sfs_image.h, each file's data going straight
+ * to its blocks, and written out once at the end, so the cost is one pass over
+ * the input rather than the per-file metadata writes of sfs_fopen() and
+ * sfs_fwrite(). With -c the data blocks get checksums, as if written with
+ * sfs_set_checksums( 1 ).
+ *
+ * SFS has a single flat directory, so subdirectories are not followed, and
+ * files whose names SFS can not hold are skipped with a warning, as are files
+ * once the inodes or blocks run out.
+ *
+ * Usage: sfs_import [-c] dir [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "sfs_image.h"
+
+#define CHUNK (64 * 1024)
+
+/* import_file() - copy the host file path into the image as fname.
+ * @return its size, or -1 if it was skipped.
+ */
+long import_file(sfs_image_t *img, const char *path, const char *fname,
+                 off_t size, char *buf)
+{
+  ssize_t n;
+  uint32_t pos = 0;
+  int fd, ino;
+
+  if (size > MAX_FILE_SIZE) {
+    fprintf(stderr, "%s: larger than %d bytes, skipped\n", path,
+            (int)MAX_FILE_SIZE);
+    return -1;
+  }
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    perror(path);
+    return -1;
+  }
+  if ((ino = sfs_image_create(img, fname, size)) == -1) {
+    fprintf(stderr, "%s: bad name, or the image is full, skipped\n", path);
+    close(fd);
+    return -1;
+  }
+  while (pos < size && (n = read(fd, buf, CHUNK)) > 0) {
+    if (n > size - pos) {
+      n = size - pos;
+    }
+    sfs_image_pwrite(img, ino, pos, buf, n);
+    pos += n;
+  }
+  close(fd);
+  return size;
+}
+
+int main(int argc, char **argv)
+{
+  char *image = DISK_NAME, path[4096];
+  struct timespec t0, t1;
+  sfs_image_t img;
+  struct dirent *de;
+  struct stat st;
+  int opt, checksums = 0, files = 0, skipped = 0;
+  long long bytes = 0;
+  long res;
+  char *buf;
+  DIR *d;
+
+  while ((opt = getopt(argc, argv, "c")) != -1) {
+    if (opt != 'c') {
+      fprintf(stderr, "usage: %s [-c] dir [image]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+    checksums = 1;
+  }
+  if (optind == argc || argc - optind > 2) {
+    fprintf(stderr, "usage: %s [-c] dir [image]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (argc - optind == 2) {
+    image = argv[optind + 1];
+  }
+  if ((d = opendir(argv[optind])) == NULL) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+  if (sfs_image_init(&img, checksums) == -1 ||
+      (buf = malloc(CHUNK)) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while ((de = readdir(d)) != NULL) {
+    snprintf(path, sizeof(path), "%s/%s", argv[optind], de->d_name);
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if ((res = import_file(&img, path, de->d_name, st.st_size, buf)) == -1) {
+      skipped++;
+      continue;
+    }
+    files++;
+    bytes += res;
+  }
+  closedir(d);
+  free(buf);
+  if (sfs_image_write(&img, image) == -1) {
+    perror(image);
+    sfs_image_free(&img);
+    return EXIT_FAILURE;
+  }
+  sfs_image_free(&img);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  printf("%s: %d files, %lld bytes imported, %d skipped, in %.3f ms\n", image,
+         files, bytes, skipped,
+         (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+  return skipped ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,79 @@
+/* sfs_layout.h
+ *
+ * The on-disk layout of an SFS volume, shared by sfs_api.c and the tools that
+ * work on a disk image directly rather than through the API, such as
+ * sfs_fsck.
+ */
+#ifndef _INCLUDE_SFS_LAYOUT_H_
+#define _INCLUDE_SFS_LAYOUT_H_
+#include <stdint.h>
+
+#include "sfs_api.h"
+
+
+// Define the name of the disk, block size, number of inodes, and the number of
+// directory blocks. These may be changed. NUM_BLOCKS has to match bitmap.h,
+// which holds the bitmap itself and so can only be included by sfs_api.c; the
+// compiler complains about the redefinition if the two differ.
+#define NUM_BLOCKS 1024
+#define DISK_NAME "test_disk.disk"
+#define BLOCK_SIZE 1024
+#define NUM_INODES 64
+#define DIR_PER_BLK ( BLOCK_SIZE/sizeof( dir_entry_t ) )
+#define NO_DIR_BLKS ( ( NUM_INODES - 1 + DIR_PER_BLK - 1 )/DIR_PER_BLK )
+#define MAX_FILE_SIZE \
+    ( 12 * BLOCK_SIZE + BLOCK_SIZE/sizeof( unsigned int ) * BLOCK_SIZE )
+#define MAX_LBLKS ( MAX_FILE_SIZE/BLOCK_SIZE )
+#define MAGIC_NUM 0xABCD000C
+
+// The disk is split into NUM_GROUPS block groups of BLKS_PER_GRP blocks each,
+// in the style of ext2, so that a file's inode, its data and the slice of the
+// free bitmap describing that data sit close together. Every group has the
+// same layout:
+//
+//   +0                 copy of the super block (the primary one in group 0)
+//   +1                 free bitmap for the blocks of this group, a set bit
+//                      meaning the block is free
+//   +2                 INODE_BLKS_PER_GRP blocks of inode table
+//   +GRP_REF_ADDR      REF_BLKS_PER_GRP blocks of reference table, one
+//                      blk_ref_t per block of the group
+//   +GRP_DATA_START    data blocks
+//
+// Inode i lives in group INODE_GROUP(i) and its data is allocated from that
+// group first.
+#define NUM_GROUPS 4
+#define BLKS_PER_GRP ( NUM_BLOCKS/NUM_GROUPS )
+#define INODES_PER_GRP ( NUM_INODES/NUM_GROUPS )
+#define GRP_BITMAP_BYTES ( BLKS_PER_GRP/8 )
+#define INODE_BLKS_PER_GRP \
+    ( ( sizeof( inode_t ) * INODES_PER_GRP + BLOCK_SIZE - 1 )/BLOCK_SIZE )
+#define REF_BLKS_PER_GRP \
+    ( ( sizeof( blk_ref_t ) * BLKS_PER_GRP + BLOCK_SIZE - 1 )/BLOCK_SIZE )
+#define GRP_DATA_START ( 2 + INODE_BLKS_PER_GRP + REF_BLKS_PER_GRP )
+#define GRP_BASE(g) ( ( g ) * BLKS_PER_GRP )
+#define GRP_BITMAP_ADDR(g) ( GRP_BASE( g ) + 1 )
+#define GRP_INODE_ADDR(g) ( GRP_BASE( g ) + 2 )
+#define GRP_REF_ADDR(g) ( GRP_INODE_ADDR( g ) + INODE_BLKS_PER_GRP )
+#define BLK_GROUP(blk) ( ( blk )/BLKS_PER_GRP )
+#define INODE_GROUP(ino) ( ( ino )/INODES_PER_GRP )
+
+
+// A snapshot taken by sfs_snapshot() is a run of SNAP_BLKS blocks starting at
+// sb.snap_root: a snap_root_t, then SNAP_INODE_BLKS blocks holding the inode
+// table and SNAP_DIR_BLKS blocks holding the directory as they were when it
+// was taken. Its inodes point to copies of the indirect blocks of the time,
+// which are not part of the run.
+#define SNAP_MAGIC 0x534e4150
+#define SNAP_INODE_BLKS \
+    ( ( NUM_INODES * sizeof( inode_t ) + BLOCK_SIZE - 1 )/BLOCK_SIZE )
+#define SNAP_DIR_BLKS \
+    ( ( ( NUM_INODES - 1 ) * sizeof( dir_entry_t ) + BLOCK_SIZE - 1 )/BLOCK_SIZE )
+#define SNAP_BLKS ( 1 + SNAP_INODE_BLKS + SNAP_DIR_BLKS )
+
+typedef struct {
+    uint32_t magic;
+    uint32_t created;
+} snap_root_t;
+
+
+#endif
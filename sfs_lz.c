@@ -0,0 +1,141 @@
+/* sfs_lz.c
+ *
+ * A small LZ77 compressor in the style of LZ4, used as the built-in codec for
+ * compressed files. The packed data is a list of sequences, each made of
+ *
+ *   token           literal count in the high 4 bits, match length minus
+ *                   LZ_MIN_MATCH in the low 4 bits
+ *   [count bytes]   when a count in the token is 15, further bytes that are
+ *                   added to it, up to the first one below 255
+ *   literals        copied to the output as they are
+ *   offset          2 bytes, little endian, how far back the match starts
+ *   [length bytes]  as for the literal count
+ *
+ * The last sequence has literals only and ends the data. Matches are found
+ * with a single hash table of recent positions, which favours speed over
+ * ratio; inputs are at most a cluster, so offsets always fit in 2 bytes.
+ */
+#include <string.h>
+
+#include "sfs_codec.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+
+static uint32_t lz_read32( const uint8_t *p )
+{
+    uint32_t v;
+    memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+
+static int lz_hash( uint32_t v )
+{
+    return ( v * 2654435761u ) >> ( 32 - LZ_HASH_BITS );
+}
+
+
+// Appends one sequence at dst + op, with no match if mlen is 0.
+// @return the new output length, or -1 if it would exceed cap.
+static int lz_emit( uint8_t *dst, int op, int cap, const uint8_t *lit, int nlit,
+                    int off, int mlen )
+{
+    int n;
+    uint8_t *token;
+    if ( op + 1 + nlit/255 + 1 + nlit + 2 + mlen/255 + 1 > cap ) return -1;
+    token = dst + op++;
+    *token = ( nlit < 15 ? nlit : 15 ) << 4;
+    if ( nlit >= 15 ) {
+        for ( n = nlit - 15; n >= 255; n -= 255 ) dst[op++] = 255;
+        dst[op++] = n;
+    }
+    memcpy( dst + op, lit, nlit );
+    op += nlit;
+    if ( mlen == 0 ) return op;
+    dst[op++] = off & 0xff;
+    dst[op++] = off >> 8;
+    mlen -= LZ_MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if ( mlen >= 15 ) {
+        for ( n = mlen - 15; n >= 255; n -= 255 ) dst[op++] = 255;
+        dst[op++] = n;
+    }
+    return op;
+}
+
+
+static int lz_compress( const uint8_t *src, int len, uint8_t *dst, int cap )
+{
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0, ref, mlen, h;
+    uint32_t seq;
+    memset( table, 0xff, sizeof( table ) );
+    while ( ip + LZ_MIN_MATCH <= len ) {
+        seq = lz_read32( src + ip );
+        h = lz_hash( seq );
+        ref = table[h];
+        table[h] = ip;
+        if ( ref < 0 || ip - ref > LZ_MAX_OFFSET ||
+             lz_read32( src + ref ) != seq ) {
+            ip++;
+            continue;
+        }
+        for ( mlen = LZ_MIN_MATCH; ip + mlen < len &&
+                                   src[ref + mlen] == src[ip + mlen]; mlen++ );
+        op = lz_emit( dst, op, cap, src + anchor, ip - anchor, ip - ref, mlen );
+        if ( op == -1 ) return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    if ( anchor < len || op == 0 ) {
+        op = lz_emit( dst, op, cap, src + anchor, len - anchor, 0, 0 );
+        if ( op == -1 ) return 0;
+    }
+    return op;
+}
+
+
+// Reads the extra bytes of a count of 15 from src + *ip.
+// @return the full count, or -1 if src ends first.
+static int lz_count( const uint8_t *src, int len, int *ip, int n )
+{
+    int b;
+    if ( n < 15 ) return n;
+    do {
+        if ( *ip >= len ) return -1;
+        b = src[( *ip )++];
+        n += b;
+    } while ( b == 255 );
+    return n;
+}
+
+
+static int lz_decompress( const uint8_t *src, int len, uint8_t *dst, int cap )
+{
+    int ip = 0, op = 0, token, n, off;
+    while ( ip < len ) {
+        token = src[ip++];
+        if ( ( n = lz_count( src, len, &ip, token >> 4 ) ) == -1 ) return -1;
+        if ( n > len - ip || n > cap - op ) return -1;
+        memcpy( dst + op, src + ip, n );
+        ip += n;
+        op += n;
+        if ( ip == len ) break;
+        if ( len - ip < 2 ) return -1;
+        off = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        if ( ( n = lz_count( src, len, &ip, token & 15 ) ) == -1 ) return -1;
+        n += LZ_MIN_MATCH;
+        if ( off == 0 || off > op || n > cap - op ) return -1;
+
+        // The match may overlap the bytes it produces, so copy bytewise.
+        for ( ; n > 0; n--, op++ ) dst[op] = dst[op - off];
+    }
+    return op;
+}
+
+
+const sfs_codec_t sfs_codec_lz = { "lz", lz_compress, lz_decompress };
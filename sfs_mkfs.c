@@ -0,0 +1,214 @@
+/* sfs_mkfs.c
+ *
+ * Builds a complete SFS disk image from a manifest, for read-mostly images
+ * that should be laid out as well as they can be. The manifest lists one file
+ * per line,
+ *
+ *   name path       copy the host file path into the image as name
+ *   path            the same, named after the last component of path
+ *
+ * with blank lines and lines starting with # ignored. The files are sorted by
+ * name and created in that order with sfs_image.h in packed mode, so the
+ * directory is sorted, the inode table is filled from the front, and the data
+ * of all the files is one sequence of blocks in directory order. Only then are
+ * the host files read, by several threads at once, straight into the blocks
+ * reserved for them, and the image is written in one pass.
+ *
+ * Unlike sfs_import, any file that can not be added fails the whole build.
+ *
+ * Usage: sfs_mkfs [-c] [-j threads] manifest [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "sfs_image.h"
+
+#define CHUNK (64 * 1024)
+#define MAX_THREADS 64
+
+typedef struct {
+  char name[MAXFILENAME];
+  char *path;
+  uint32_t size;
+  int ino;
+} entry_t;
+
+static sfs_image_t img;
+static entry_t *entries;
+static int nentries, next_entry, failed;
+
+/* parse_manifest() - read the manifest into entries, checking that every
+ * file exists and fits in a file of the image.
+ * @return 0, or -1 after reporting the first bad line.
+ */
+int parse_manifest(const char *fname)
+{
+  char line[4096], name[4096], path[4096], *base;
+  struct stat st;
+  int lineno = 0, cap = 0, n;
+  FILE *in;
+
+  if ((in = fopen(fname, "r")) == NULL) {
+    perror(fname);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), in) != NULL) {
+    lineno++;
+    if ((n = sscanf(line, "%4095s %4095s", name, path)) < 1 || name[0] == '#') {
+      continue;
+    }
+    if (n == 1) {
+      strcpy(path, name);
+      base = strrchr(path, '/');
+      strcpy(name, base ? base + 1 : path);
+    }
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_size > MAX_FILE_SIZE || strlen(name) >= MAXFILENAME) {
+      fprintf(stderr, "%s:%d: %s is missing, not a regular file, too large "
+              "or named %s\n", fname, lineno, path, name);
+      fclose(in);
+      return -1;
+    }
+    if (nentries == cap) {
+      cap = cap ? 2 * cap : 64;
+      entries = realloc(entries, cap * sizeof(entry_t));
+    }
+    strcpy(entries[nentries].name, name);
+    entries[nentries].path = strdup(path);
+    entries[nentries].size = st.st_size;
+    nentries++;
+  }
+  fclose(in);
+  return 0;
+}
+
+int cmp_entry(const void *a, const void *b)
+{
+  return strcmp(((const entry_t *)a)->name, ((const entry_t *)b)->name);
+}
+
+/* reader() - copy host files into the image until none are left. Files are
+ * handed out one at a time, in directory order, so the threads move over the
+ * image together.
+ */
+void *reader(void *arg)
+{
+  char *buf = malloc(CHUNK);
+  entry_t *e;
+  uint32_t pos;
+  ssize_t n;
+  int i, fd;
+
+  for (;;) {
+    i = __atomic_fetch_add(&next_entry, 1, __ATOMIC_RELAXED);
+    if (i >= nentries) {
+      break;
+    }
+    e = &entries[i];
+    if ((fd = open(e->path, O_RDONLY)) < 0) {
+      perror(e->path);
+      __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    for (pos = 0; pos < e->size; pos += n) {
+      n = pread(fd, buf, e->size - pos < CHUNK ? e->size - pos : CHUNK, pos);
+      if (n <= 0) {
+        fprintf(stderr, "%s: shorter than when the manifest was read\n",
+                e->path);
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        break;
+      }
+      sfs_image_pwrite(&img, e->ino, pos, buf, n);
+    }
+    close(fd);
+  }
+  free(buf);
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  char *image = DISK_NAME;
+  pthread_t tids[MAX_THREADS];
+  struct timespec t0, t1;
+  int opt, i, checksums = 0, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  long long bytes = 0;
+  double ms;
+
+  while ((opt = getopt(argc, argv, "cj:")) != -1) {
+    if (opt == 'c') {
+      checksums = 1;
+    }
+    else if (opt == 'j') {
+      nthreads = atoi(optarg);
+    }
+    else {
+      fprintf(stderr, "usage: %s [-c] [-j threads] manifest [image]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind == argc || argc - optind > 2) {
+    fprintf(stderr, "usage: %s [-c] [-j threads] manifest [image]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (argc - optind == 2) {
+    image = argv[optind + 1];
+  }
+  nthreads = nthreads < 1 ? 1 : nthreads > MAX_THREADS ? MAX_THREADS : nthreads;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (parse_manifest(argv[optind]) == -1) {
+    return EXIT_FAILURE;
+  }
+  if (sfs_image_init(&img, checksums) == -1) {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+  img.packed = 1;
+
+  /* Lay out the files in name order first, so the reads below can go to
+   * their final place in parallel.
+   */
+  qsort(entries, nentries, sizeof(entry_t), cmp_entry);
+  for (i = 0; i < nentries; i++) {
+    if ((entries[i].ino = sfs_image_create(&img, entries[i].name,
+                                           entries[i].size)) == -1) {
+      fprintf(stderr, "%s: bad or duplicate name, or the image is full\n",
+              entries[i].name);
+      return EXIT_FAILURE;
+    }
+    bytes += entries[i].size;
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_create(&tids[i], NULL, reader, NULL);
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  if (failed) {
+    return EXIT_FAILURE;
+  }
+  if (sfs_image_write(&img, image) == -1) {
+    perror(image);
+    return EXIT_FAILURE;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  printf("%s: %d files, %lld bytes, %u blocks free, in %.3f ms with %d "
+         "threads\n", image, nentries, bytes, img.sb.free_blk_cnt, ms,
+         nthreads);
+  sfs_image_free(&img);
+  for (i = 0; i < nentries; i++) {
+    free(entries[i].path);
+  }
+  free(entries);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+/* sfs_replay.c
+ *
+ * Summarises a block I/O trace recorded by the disk emulator and optionally
+ * replays it against a disk image. Run any program with SFS_DISK_TRACE set to
+ * a file name to record one; the trace is written when the disk is closed.
+ *
+ * The summary covers, per request type and overall:
+ *
+ *   seek distance   blocks between the end of one request and the start of
+ *                   the next
+ *   sequentiality   share of requests that start where the previous ended
+ *   write amp.      blocks written in total per block of file data written
+ *
+ * and breaks the requests down by the tag sfs_api.c attached to them. When an
+ * image is given, every request is issued to it again through read_blocks()
+ * and write_blocks() under the device model picked with SFS_DISK_PROFILE and
+ * the time taken is reported. Writes put back the blocks' current contents,
+ * so the image is left unchanged.
+ *
+ * Usage: sfs_replay trace [image]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+static const char *tag_names[SFS_NUM_TAGS] = {
+  "none", "super", "bitmap", "inode", "dir", "indirect", "data", "refs",
+  "snap"
+};
+
+typedef struct {
+  long reqs, seq;
+  long blks;
+  double seek_sum;
+  long seek_max;
+} io_summary_t;
+
+/* load_trace() - read the header and records of a trace file, or return NULL
+ * if it isn't one.
+ */
+disk_trace_rec_t *load_trace(char *fname, disk_trace_hdr_t *hdr)
+{
+  disk_trace_rec_t *recs;
+  FILE *in;
+
+  if ((in = fopen(fname, "rb")) == NULL) {
+    perror(fname);
+    return NULL;
+  }
+  if (fread(hdr, sizeof(*hdr), 1, in) != 1 || hdr->magic != DISK_TRACE_MAGIC ||
+      hdr->version != DISK_TRACE_VERSION) {
+    fprintf(stderr, "%s: not a disk trace\n", fname);
+    fclose(in);
+    return NULL;
+  }
+  recs = malloc((hdr->count + 1) * sizeof(disk_trace_rec_t));
+  if (fread(recs, sizeof(disk_trace_rec_t), hdr->count, in) != hdr->count) {
+    fprintf(stderr, "%s: trace is truncated\n", fname);
+    fclose(in);
+    free(recs);
+    return NULL;
+  }
+  fclose(in);
+  return recs;
+}
+
+void print_summary(const char *name, io_summary_t *s)
+{
+  printf("%-8s %8ld requests %9ld blocks  seek mean %8.1f max %6ld  "
+         "sequential %5.1f%%\n", name, s->reqs, s->blks,
+         s->reqs ? s->seek_sum / s->reqs : 0, s->seek_max,
+         s->reqs ? 100.0 * s->seq / s->reqs : 0);
+}
+
+void summarise(disk_trace_hdr_t *hdr, disk_trace_rec_t *recs)
+{
+  io_summary_t kinds[2], all;
+  long tag_reqs[SFS_NUM_TAGS] = { 0 }, tag_read[SFS_NUM_TAGS] = { 0 };
+  long tag_written[SFS_NUM_TAGS] = { 0 };
+  long prev_end = 0, dist, i;
+  io_summary_t *k;
+  int tag;
+
+  memset(kinds, 0, sizeof(kinds));
+  memset(&all, 0, sizeof(all));
+  for (i = 0; i < hdr->count; i++) {
+    dist = labs((long)recs[i].start - prev_end);
+    prev_end = recs[i].start + recs[i].nblocks;
+    k = &kinds[recs[i].op == DISK_TRACE_WRITE];
+    k->reqs++;
+    k->blks += recs[i].nblocks;
+    k->seek_sum += dist;
+    k->seq += dist == 0;
+    if (dist > k->seek_max) {
+      k->seek_max = dist;
+    }
+    tag = recs[i].tag < SFS_NUM_TAGS ? recs[i].tag : SFS_TAG_NONE;
+    tag_reqs[tag]++;
+    if (recs[i].op == DISK_TRACE_WRITE) {
+      tag_written[tag] += recs[i].nblocks;
+    }
+    else {
+      tag_read[tag] += recs[i].nblocks;
+    }
+  }
+  all.reqs = kinds[0].reqs + kinds[1].reqs;
+  all.blks = kinds[0].blks + kinds[1].blks;
+  all.seq = kinds[0].seq + kinds[1].seq;
+  all.seek_sum = kinds[0].seek_sum + kinds[1].seek_sum;
+  all.seek_max = kinds[0].seek_max > kinds[1].seek_max ?
+                 kinds[0].seek_max : kinds[1].seek_max;
+
+  printf("%llu requests over %.3f s on a %u x %u byte disk\n",
+         (unsigned long long)hdr->count,
+         hdr->count ? recs[hdr->count - 1].ts_us / 1e6 : 0,
+         hdr->num_blocks, hdr->block_size);
+  print_summary("read", &kinds[0]);
+  print_summary("write", &kinds[1]);
+  print_summary("total", &all);
+  if (tag_written[SFS_TAG_DATA] > 0) {
+    printf("write amplification %.2f (%ld blocks written for %ld data blocks)\n",
+           (double)kinds[1].blks / tag_written[SFS_TAG_DATA], kinds[1].blks,
+           tag_written[SFS_TAG_DATA]);
+  }
+  else {
+    printf("write amplification n/a (no data blocks written)\n");
+  }
+  printf("\n%-8s %8s %10s %10s\n", "tag", "requests", "blks read", "blks written");
+  for (tag = 0; tag < SFS_NUM_TAGS; tag++) {
+    if (tag_reqs[tag] > 0) {
+      printf("%-8s %8ld %10ld %10ld\n", tag_names[tag], tag_reqs[tag],
+             tag_read[tag], tag_written[tag]);
+    }
+  }
+}
+
+/* replay() - issue every request in the trace to the image again. Blocks about
+ * to be written are first read straight from the file, outside the device
+ * model, so the write leaves them as they were.
+ */
+int replay(char *image, disk_trace_hdr_t *hdr, disk_trace_rec_t *recs)
+{
+  struct timespec t0, t1;
+  char *buf;
+  FILE *raw;
+  long i, max = 1;
+  double secs;
+
+  if ((raw = fopen(image, "rb")) == NULL) {
+    perror(image);
+    return -1;
+  }
+  if (init_disk(image, hdr->block_size, hdr->num_blocks) == -1) {
+    fclose(raw);
+    return -1;
+  }
+  for (i = 0; i < hdr->count; i++) {
+    if (recs[i].nblocks > max) {
+      max = recs[i].nblocks;
+    }
+  }
+  buf = malloc(max * hdr->block_size);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < hdr->count; i++) {
+    if (recs[i].op == DISK_TRACE_WRITE) {
+      pread(fileno(raw), buf, recs[i].nblocks * hdr->block_size,
+            (off_t)recs[i].start * hdr->block_size);
+      write_blocks(recs[i].start, recs[i].nblocks, buf);
+    }
+    else {
+      read_blocks(recs[i].start, recs[i].nblocks, buf);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  close_disk();
+  fclose(raw);
+  free(buf);
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("\nreplayed in %.3f s (%.0f requests/s) with profile %s\n", secs,
+         secs > 0 ? hdr->count / secs : 0,
+         getenv("SFS_DISK_PROFILE") ? getenv("SFS_DISK_PROFILE") : "none");
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  disk_trace_hdr_t hdr;
+  disk_trace_rec_t *recs;
+  int res = 0;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s trace [image]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  /* Don't record the replay into the trace being read. */
+  unsetenv("SFS_DISK_TRACE");
+  if ((recs = load_trace(argv[1], &hdr)) == NULL) {
+    return EXIT_FAILURE;
+  }
+  summarise(&hdr, recs);
+  if (argc == 3) {
+    res = replay(argv[2], &hdr, recs);
+  }
+  free(recs);
+  return res ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,442 @@
+/* sfs_workload.c
+ *
+ * Configurable load generator. Each job in a job file describes a set of files
+ * and a mix of reads and writes that a number of threads run against them,
+ * either through sfs_api.h directly or, with -m, through the POSIX calls on a
+ * mounted fuse_wrappers file system. For every job the throughput and the
+ * latency percentiles of reads and writes are reported.
+ *
+ * A job file is a list of sections in the style of fio:
+ *
+ *   [small_files]        name of the job
+ *   threads=4            threads issuing requests
+ *   files=48             files, split evenly between the threads
+ *   size=64-2k           file size in bytes, uniform in the range, or fixed
+ *   bs=512               bytes per read or write
+ *   ops=2000             requests per thread
+ *   read_pct=70          share of the requests that are reads
+ *   pattern=random       random offsets, or seq to walk each file in order
+ *   fsync_every=16       fsync() after this many writes, 0 never
+ *   codec=lz             compress the files with this codec, or none
+ *   dedup=1              share identical data blocks between files, 0 not
+ *
+ * Sizes take k and m suffixes. Each thread only uses its own files, since
+ * sfs_fopen() hands out one shared descriptor per file. The library is not
+ * reentrant, so in library mode the calls are serialized with a mutex and the
+ * latencies include the time spent waiting for it. Every sfs_fwrite() is
+ * written through to the disk, so fsync_every only applies to -m. The codec
+ * and dedup are also library mode only; for a codec the job reports how much
+ * space the files took on disk compared to their size, and for dedup how many
+ * of their blocks were shared.
+ *
+ * Usage: sfs_workload [-m mountdir] jobfile ...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sfs_api.h"
+
+#define MAX_JOBS 16
+#define MAX_FILES 63     /* Files the inode table has room for */
+
+typedef struct {
+  char name[32];
+  int threads, files, bs, ops, read_pct, random, fsync_every, codec, dedup;
+  long size_min, size_max;
+} job_t;
+
+typedef struct {
+  job_t *job;
+  int id;
+  unsigned int seed;
+  int nfiles;
+  char names[MAX_FILES][MAXFILENAME];
+  long sizes[MAX_FILES];
+  long pos[MAX_FILES];
+  double *rd_lat, *wr_lat;
+  int nrd, nwr;
+  long bytes;
+  long logical, stored, shared;
+} worker_t;
+
+static char *mount_dir = NULL;
+static pthread_mutex_t sfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+double now_us()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+long parse_size(const char *s)
+{
+  char *end;
+  long v = strtol(s, &end, 10);
+  if (*end == 'k' || *end == 'K') {
+    v *= 1024;
+  }
+  else if (*end == 'm' || *end == 'M') {
+    v *= 1024 * 1024;
+  }
+  return v;
+}
+
+/* load_jobs() - parse a job file into jobs, starting each job from the
+ * defaults. Returns the number of jobs, or -1 on error.
+ */
+int load_jobs(char *fname, job_t *jobs)
+{
+  char line[256], *key, *val, *p;
+  int n = -1, lineno = 0;
+  FILE *in;
+
+  if ((in = fopen(fname, "r")) == NULL) {
+    perror(fname);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), in) != NULL) {
+    lineno++;
+    if ((p = strchr(line, '#')) != NULL) {
+      *p = '\0';
+    }
+    for (key = line; isspace((unsigned char)*key); key++);
+    for (p = key + strlen(key); p > key && isspace((unsigned char)p[-1]); p--);
+    *p = '\0';
+    if (*key == '\0') {
+      continue;
+    }
+    if (*key == '[') {
+      if (++n == MAX_JOBS) {
+        fprintf(stderr, "%s: too many jobs\n", fname);
+        break;
+      }
+      job_t def = { "", 1, 8, 1024, 1000, 50, 1, 0, SFS_CODEC_NONE, 0, 1024,
+                    1024 };
+      jobs[n] = def;
+      if ((p = strchr(key, ']')) != NULL) {
+        *p = '\0';
+      }
+      snprintf(jobs[n].name, sizeof(jobs[n].name), "%s", key + 1);
+      continue;
+    }
+    if (n < 0 || (val = strchr(key, '=')) == NULL) {
+      fprintf(stderr, "%s:%d: expected [job] or key=value\n", fname, lineno);
+      fclose(in);
+      return -1;
+    }
+    *val++ = '\0';
+    if (strcmp(key, "threads") == 0) {
+      jobs[n].threads = atoi(val);
+    }
+    else if (strcmp(key, "files") == 0) {
+      jobs[n].files = atoi(val);
+    }
+    else if (strcmp(key, "size") == 0) {
+      jobs[n].size_min = parse_size(val);
+      p = strchr(val, '-');
+      jobs[n].size_max = p ? parse_size(p + 1) : jobs[n].size_min;
+    }
+    else if (strcmp(key, "bs") == 0) {
+      jobs[n].bs = parse_size(val);
+    }
+    else if (strcmp(key, "ops") == 0) {
+      jobs[n].ops = atoi(val);
+    }
+    else if (strcmp(key, "read_pct") == 0) {
+      jobs[n].read_pct = atoi(val);
+    }
+    else if (strcmp(key, "pattern") == 0) {
+      jobs[n].random = strcmp(val, "seq") != 0;
+    }
+    else if (strcmp(key, "fsync_every") == 0) {
+      jobs[n].fsync_every = atoi(val);
+    }
+    else if (strcmp(key, "codec") == 0) {
+      if (strcmp(val, "lz") == 0) {
+        jobs[n].codec = SFS_CODEC_LZ;
+      }
+      else if (strcmp(val, "none") == 0) {
+        jobs[n].codec = SFS_CODEC_NONE;
+      }
+      else {
+        fprintf(stderr, "%s:%d: unknown codec %s\n", fname, lineno, val);
+      }
+    }
+    else if (strcmp(key, "dedup") == 0) {
+      jobs[n].dedup = atoi(val) != 0;
+    }
+    else {
+      fprintf(stderr, "%s:%d: unknown key %s\n", fname, lineno, key);
+    }
+  }
+  fclose(in);
+  if (n >= MAX_JOBS) {
+    n = MAX_JOBS - 1;
+  }
+  return n + 1;
+}
+
+/* The same three operations in library and mount mode. In mount mode the
+ * file is opened and closed around every request; in library mode
+ * sfs_fopen() returns the descriptor already open for the file. */
+int wl_write(worker_t *w, int f, char *buf, long off, int len, int sync)
+{
+  char path[512];
+  int fd, res;
+
+  if (mount_dir == NULL) {
+    pthread_mutex_lock(&sfs_lock);
+    fd = sfs_fopen(w->names[f]);
+    sfs_fseek(fd, off);
+    res = sfs_fwrite(fd, buf, len);
+    pthread_mutex_unlock(&sfs_lock);
+    return res;
+  }
+  snprintf(path, sizeof(path), "%s/%s", mount_dir, w->names[f]);
+  if ((fd = open(path, O_WRONLY | O_CREAT, 0666)) < 0) {
+    return -1;
+  }
+  res = pwrite(fd, buf, len, off);
+  if (sync) {
+    fsync(fd);
+  }
+  close(fd);
+  return res;
+}
+
+int wl_read(worker_t *w, int f, char *buf, long off, int len)
+{
+  char path[512];
+  int fd, res;
+
+  if (mount_dir == NULL) {
+    pthread_mutex_lock(&sfs_lock);
+    fd = sfs_fopen(w->names[f]);
+    sfs_fseek(fd, off);
+    res = sfs_fread(fd, buf, len);
+    pthread_mutex_unlock(&sfs_lock);
+    return res;
+  }
+  snprintf(path, sizeof(path), "%s/%s", mount_dir, w->names[f]);
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return -1;
+  }
+  res = pread(fd, buf, len, off);
+  close(fd);
+  return res;
+}
+
+void wl_remove(worker_t *w, int f)
+{
+  char path[512];
+
+  sfs_file_stats_t st;
+
+  if (mount_dir == NULL) {
+    pthread_mutex_lock(&sfs_lock);
+    if (sfs_file_stats(w->names[f], &st) == 0) {
+      w->logical += st.size;
+      w->stored += st.stored;
+      w->shared += st.shared;
+    }
+    sfs_remove(w->names[f]);
+    pthread_mutex_unlock(&sfs_lock);
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/%s", mount_dir, w->names[f]);
+  unlink(path);
+}
+
+/* run_worker() - create and fill this thread's files, then issue ops
+ * requests against them, timing each one.
+ */
+void *run_worker(void *arg)
+{
+  worker_t *w = arg;
+  job_t *job = w->job;
+  char *buf = malloc(job->bs);
+  int i, f, len, writes = 0;
+  long off, done;
+  double t0;
+
+  memset(buf, 'a' + w->id % 26, job->bs);
+  for (f = 0; f < w->nfiles; f++) {
+    for (done = 0; done < w->sizes[f]; done += len) {
+      len = w->sizes[f] - done < job->bs ? w->sizes[f] - done : job->bs;
+      if (wl_write(w, f, buf, done, len, 0) <= 0) {
+        break;
+      }
+    }
+    w->sizes[f] = done;
+  }
+  for (i = 0; i < job->ops; i++) {
+    f = rand_r(&w->seed) % w->nfiles;
+    if (w->sizes[f] == 0) {
+      continue;
+    }
+    len = w->sizes[f] < job->bs ? w->sizes[f] : job->bs;
+    if (job->random) {
+      off = (rand_r(&w->seed) % ((w->sizes[f] - len) / job->bs + 1)) * job->bs;
+    }
+    else {
+      off = w->pos[f] + len > w->sizes[f] ? 0 : w->pos[f];
+      w->pos[f] = off + len;
+    }
+    t0 = now_us();
+    if (rand_r(&w->seed) % 100 < job->read_pct) {
+      wl_read(w, f, buf, off, len);
+      w->rd_lat[w->nrd++] = now_us() - t0;
+    }
+    else {
+      writes++;
+      wl_write(w, f, buf, off, len,
+               job->fsync_every > 0 && writes % job->fsync_every == 0);
+      w->wr_lat[w->nwr++] = now_us() - t0;
+    }
+    w->bytes += len;
+  }
+  for (f = 0; f < w->nfiles; f++) {
+    wl_remove(w, f);
+  }
+  if (mount_dir == NULL) {
+    pthread_mutex_lock(&sfs_lock);
+    sfs_flush_reservations();
+    pthread_mutex_unlock(&sfs_lock);
+  }
+  free(buf);
+  return NULL;
+}
+
+void print_latency(const char *name, double *lat, int n)
+{
+  if (n == 0) {
+    return;
+  }
+  qsort(lat, n, sizeof(double), cmp_double);
+  printf("  %-5s %7d ops  p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", name,
+         n, lat[n / 2], lat[n * 99 / 100], lat[n - 1]);
+}
+
+int run_job(job_t *job)
+{
+  worker_t *w = calloc(job->threads, sizeof(worker_t));
+  pthread_t *tids = malloc(job->threads * sizeof(pthread_t));
+  double *rd, *wr, t0, us;
+  int i, f, nrd = 0, nwr = 0;
+  long bytes = 0, logical = 0, stored = 0, shared = 0;
+
+  if (job->threads < 1 || job->files < job->threads || job->files > MAX_FILES ||
+      job->bs < 1 || job->size_min < 0 || job->size_max < job->size_min) {
+    fprintf(stderr, "%s: invalid job parameters\n", job->name);
+    free(w);
+    free(tids);
+    return -1;
+  }
+  if (mount_dir == NULL) {
+    mksfs(1);
+    sfs_set_codec(job->codec);
+    sfs_set_dedup(job->dedup);
+  }
+  for (i = 0; i < job->threads; i++) {
+    w[i].job = job;
+    w[i].id = i;
+    w[i].seed = 310 + i;
+    w[i].rd_lat = malloc(job->ops * sizeof(double));
+    w[i].wr_lat = malloc(job->ops * sizeof(double));
+  }
+  for (f = 0; f < job->files; f++) {
+    worker_t *o = &w[f % job->threads];
+    snprintf(o->names[o->nfiles], MAXFILENAME, "w%d_%d.dat", o->id, o->nfiles);
+    o->sizes[o->nfiles] = job->size_min +
+        rand_r(&o->seed) % (job->size_max - job->size_min + 1);
+    o->nfiles++;
+  }
+  t0 = now_us();
+  for (i = 0; i < job->threads; i++) {
+    pthread_create(&tids[i], NULL, run_worker, &w[i]);
+  }
+  for (i = 0; i < job->threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  us = now_us() - t0;
+  if (mount_dir == NULL) {
+    sfs_unmount();
+  }
+
+  rd = malloc((long)job->threads * job->ops * sizeof(double));
+  wr = malloc((long)job->threads * job->ops * sizeof(double));
+  for (i = 0; i < job->threads; i++) {
+    memcpy(rd + nrd, w[i].rd_lat, w[i].nrd * sizeof(double));
+    memcpy(wr + nwr, w[i].wr_lat, w[i].nwr * sizeof(double));
+    nrd += w[i].nrd;
+    nwr += w[i].nwr;
+    bytes += w[i].bytes;
+    logical += w[i].logical;
+    stored += w[i].stored;
+    shared += w[i].shared;
+    free(w[i].rd_lat);
+    free(w[i].wr_lat);
+  }
+  printf("%s: %d threads, %d files, %s, %.3f s total\n", job->name,
+         job->threads, job->files, mount_dir ? mount_dir : "library", us / 1e6);
+  printf("  %.0f ops/s  %.2f MB/s\n", (nrd + nwr) / us * 1e6,
+         bytes / us * 1e6 / (1024 * 1024));
+  print_latency("read", rd, nrd);
+  print_latency("write", wr, nwr);
+  if (job->codec != SFS_CODEC_NONE && stored > 0) {
+    printf("  stored %ld KiB for %ld KiB, ratio %.2f\n", stored / 1024,
+           logical / 1024, (double)logical / stored);
+  }
+  if (job->dedup && stored > 0) {
+    printf("  %ld of %ld KiB stored in shared blocks\n", shared / 1024,
+           stored / 1024);
+  }
+  free(rd);
+  free(wr);
+  free(w);
+  free(tids);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  job_t jobs[MAX_JOBS];
+  int i, j, n, opt, errors = 0;
+
+  while ((opt = getopt(argc, argv, "m:")) != -1) {
+    if (opt == 'm') {
+      mount_dir = optarg;
+    }
+    else {
+      fprintf(stderr, "usage: %s [-m mountdir] jobfile ...\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind == argc) {
+    fprintf(stderr, "usage: %s [-m mountdir] jobfile ...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  for (i = optind; i < argc; i++) {
+    if ((n = load_jobs(argv[i], jobs)) < 0) {
+      errors++;
+      continue;
+    }
+    for (j = 0; j < n; j++) {
+      errors += run_job(&jobs[j]) != 0;
+    }
+  }
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
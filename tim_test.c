@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "sfs_api.h"
+#include "disk_emu.h"
 
 
 int main( int argc, char* argv[] )
@@ -18,5 +21,104 @@ int main( int argc, char* argv[] )
     test_str2[45] = '\0';
     bytes = sfs_fread( fd, test_str2, strlen( test_str ) - 10 );
     printf( "No. of bytes read: %d\n%s", bytes, test_str2 );
-    return EXIT_SUCCESS;
+
+    // Unmount cleanly and check that the file survives a fast remount
+    sfs_unmount();
+    mksfs( 0 );
+    fd = sfs_fopen( fname );
+    sfs_fseek( fd, 0 );
+    bytes = sfs_fread( fd, test_str2, strlen( test_str ) );
+    printf( "No. of bytes read after remount: %d\n%s", bytes, test_str2 );
+    sfs_unmount();
+
+    // Interleave removals with writes, so that the reclaimer frees blocks
+    // while other files are being extended, and leave the volume for
+    // sfs_fsck to check (make check). First a fixed order: the reclaimer
+    // writes out the bitmap of a group this thread still has blocks reserved
+    // in, then the thread moves on to another group.
+    char name[16], buf[3000];
+    int i, j, len, fd2, res, err, size, kept;
+    disk_model_t model, bad;
+    memset( buf, 'x', sizeof( buf ) );
+    mksfs( 1 );
+    fd = sfs_fopen( "a.txt" );
+    sfs_fwrite( fd, buf, sizeof( buf ) );
+    fd2 = sfs_fopen( "b.txt" );
+    sfs_remove( "a.txt" );
+    usleep( 20000 );
+    sfs_fwrite( fd2, buf, sizeof( buf ) );
+
+    // Remount without unmounting first. The blocks this thread still has
+    // reserved from writing b.txt must not be handed out under the new mount,
+    // whose bitmap has them free; a write past the end of b.txt has no block
+    // to follow and goes to the reservation pool.
+    mksfs( 0 );
+    fd2 = sfs_fopen( "b.txt" );
+    sfs_fseek( fd2, 20000 );
+    sfs_fwrite( fd2, buf, sizeof( buf ) );
+    sfs_unmount();
+
+    // Then a random mix, with compression and dedup on
+    srand( 1 );
+    mksfs( 0 );
+    sfs_set_dedup( 1 );
+    sfs_set_codec( SFS_CODEC_LZ );
+    for ( i = 0; i < 2000; i++ ) {
+        sprintf( name, "f%d.txt", rand() % 40 );
+        if ( rand() % 4 == 0 ) {
+            sfs_remove( name );
+            if ( i % 50 == 0 ) usleep( 10000 );
+            continue;
+        }
+        if ( ( fd = sfs_fopen( name ) ) < 0 ) continue;
+        len = rand() % sizeof( buf );
+        for ( j = 0; j < len; j++ ) buf[j] = rand() % 3 ? 'a' + j % 7 : rand();
+        sfs_fseek( fd, rand() % 2000 );
+        sfs_fwrite( fd, buf, len );
+    }
+    printf( "Interleaved %d removes and writes\n", i );
+
+    // The blocks sfs_fcreate() reserves, which removed files above have left
+    // data in, read back as zeros once a truncate makes them part of the file
+    char *big = malloc( 20000 );
+    for ( i = 0; i < 40; i++ ) {
+        sprintf( name, "f%d.txt", i );
+        sfs_remove( name );
+    }
+    usleep( 20000 );
+    sfs_set_codec( SFS_CODEC_NONE );
+    fd = sfs_fcreate( "hint.txt", 20000 );
+    sfs_ftruncate( fd, 20000 );
+    sfs_fseek( fd, 0 );
+    bytes = sfs_fread( fd, big, 20000 );
+    for ( i = 0, j = 0; i < bytes; i++ ) j += big[i] != 0;
+    printf( "Read %d bytes after sfs_fcreate() and a truncate, %d not zero\n",
+            bytes, j );
+    free( big );
+
+    // A disk model set through the API survives a remount, and a disk that
+    // fails every transfer makes a write fail with EIO, leaving the file as it
+    // was, instead of ending the program
+    sfs_unmount();
+    disk_get_model( &model );
+    bad = model;
+    bad.max_retry = 7;
+    disk_set_model( &bad );
+    mksfs( 0 );
+    disk_get_model( &bad );
+    kept = bad.max_retry == 7;
+    fd = sfs_fopen( "hint.txt" );
+    bad.fail_prob = 1;
+    bad.max_retry = 0;
+    disk_set_model( &bad );
+    sfs_fseek( fd, 20000 );
+    res = sfs_fwrite( fd, buf, sizeof( buf ) );
+    err = errno;
+    disk_set_model( &model );
+    size = sfs_getfilesize( "hint.txt" );
+    printf( "Write to a failing disk returned %d (%s), size %d, model %s\n", 
+            res, strerror( err ), size, kept ? "kept" : "lost" );
+    sfs_unmount();
+    return bytes == 20000 && j == 0 && kept && res == -1 && err == EIO &&
+           size == 20000 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file